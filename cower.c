@@ -28,16 +28,32 @@
 #define _GNU_SOURCE
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <locale.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <wordexp.h>
 
@@ -47,6 +63,7 @@
 #include <archive_entry.h>
 #include <curl/curl.h>
 #include <openssl/crypto.h>
+#include <openssl/sha.h>
 #include <yajl/yajl_parse.h>
 
 /* macros {{{ */
@@ -66,6 +83,7 @@
 #define AUR_BASE_URL          "https://aur.archlinux.org"
 #define AUR_PKG_URL_FORMAT    AUR_BASE_URL "/packages/"
 #define AUR_RPC_URL           AUR_BASE_URL "/rpc.php?type=%s&arg=%s"
+#define AUR_MULTIINFO_URL     AUR_BASE_URL "/rpc.php?v=5&type=info"
 
 #define NC                    "\033[0m"
 #define BOLD                  "\033[1m"
@@ -112,12 +130,33 @@ typedef enum __operation_t {
 
 enum {
 	OP_DEBUG = 1000,
+	OP_CACHEDIR,
+	OP_DAEMON,
+	OP_DEADLINE,
+	OP_DLBURST,
+	OP_DLRATE,
 	OP_FORMAT,
+	OP_HEDGE,
 	OP_IGNOREPKG,
 	OP_IGNOREREPO,
+	OP_INCREMENTAL,
+	OP_LIMIT,
 	OP_LISTDELIM,
+	OP_LOWSPEEDLIMIT,
+	OP_LOWSPEEDTIME,
+	OP_METRICS,
+	OP_NODAEMON,
+	OP_OUTPUT,
+	OP_PRUNE,
+	OP_REQTIMEOUT,
+	OP_RETRIES,
+	OP_RPCBURST,
+	OP_RPCRATE,
+	OP_SORT,
 	OP_THREADS,
+	OP_TIMELINE,
 	OP_TIMEOUT,
+	OP_TRACE,
 	OP_VERSION,
 	OP_NOIGNOREOOD
 };
@@ -136,8 +175,15 @@ enum {
 	KEY_URL,
 	KEY_URLPATH,
 	KEY_VERSION,
+	KEY_CONFLICTS,
+	KEY_DEPENDS,
+	KEY_MAKEDEPENDS,
+	KEY_OPTDEPENDS,
+	KEY_PROVIDES,
+	KEY_REPLACES,
 	KEY_QUERY_RESULTCOUNT,
 	KEY_QUERY_RESULTS,
+	KEY_QUERY_VERSION,
 };
 
 typedef enum __pkgdetail_t {
@@ -150,6 +196,61 @@ typedef enum __pkgdetail_t {
 	PKGDETAIL_MAX
 } pkgdetail_t;
 
+typedef enum __sortkey_t {
+	SORT_NAME = 0,
+	SORT_VOTES,
+	SORT_LASTMOD,
+	SORT_FIRSTSUB
+} sortkey_t;
+
+typedef enum __output_t {
+	OUTPUT_HUMAN = 0,
+	OUTPUT_JSONL,
+	OUTPUT_BINARY
+} output_t;
+
+typedef enum __alpmcache_t {
+	CACHE_LOCALDB = 1,
+	CACHE_SYNCDBS = (1 << 1)
+} alpmcache_t;
+
+typedef enum __reqtype_t {
+	REQUEST_RPC = 0,
+	REQUEST_PKGBUILD,
+	REQUEST_TARBALL,
+	REQUEST_MAX
+} reqtype_t;
+
+typedef enum __metric_t {
+	METRIC_DOWNLOADS = 0,
+	METRIC_BYTES,
+	METRIC_CACHE_HITS,
+	METRIC_CACHE_MISSES,
+	METRIC_RETRIES,
+	METRIC_TRANSFER_ERRORS,
+	METRIC_MAX
+} metric_t;
+
+typedef enum __phase_t {
+	PHASE_SETUP = 0,
+	PHASE_JOIN,
+	PHASE_PRINT,
+	PHASE_MAX
+} phase_t;
+
+typedef enum __extinfostate_t {
+	EXTINFO_WAITING = 0,
+	EXTINFO_RUNNING,
+	EXTINFO_DONE
+} extinfostate_t;
+
+typedef enum __stage_t {
+	STAGE_FETCH = 0,
+	STAGE_EXTRACT,
+	STAGE_SCAN,
+	STAGE_MAX
+} stage_t;
+
 struct key_t {
 	int id;
 	const char *name;
@@ -169,8 +270,8 @@ struct strings_t {
 
 struct aurpkg_t {
 	char *desc;
-	char *lic;
-	char *maint;
+	const char *lic;
+	const char *maint;
 	char *name;
 	char *url;
 	char *urlpath;
@@ -181,26 +282,50 @@ struct aurpkg_t {
 	int votes;
 	time_t firstsub;
 	time_t lastmod;
-	alpm_list_t *conflicts;
-	alpm_list_t *depends;
-	alpm_list_t *makedepends;
-	alpm_list_t *optdepends;
-	alpm_list_t *provides;
-	alpm_list_t *replaces;
+	/* every dependency list back to back, each one starting at its
+	 * PKGDETAIL_* offset. The strings themselves are interned */
+	const char **details;
+	unsigned short detailoff[PKGDETAIL_MAX + 1];
+};
+
+struct topk_t {
+	struct aurpkg_t **pkgs;
+	size_t count;
+	size_t capacity;
+	size_t limit;
 };
 
 struct yajl_parser_t {
 	alpm_list_t *pkglist;
+	struct topk_t topk;
 	int resultcount;
+	int version;
 	struct aurpkg_t *aurpkg;
 	int key;
 	int json_depth;
+	size_t expect;
+	size_t seen;
+	int wantversion;
+	int done;
 	char *error;
+	yajl_handle handle;
 };
 
 struct response_t {
 	char *data;
 	size_t size;
+	size_t capacity;
+	CURL *handle;
+};
+
+struct request_t {
+	reqtype_t type;
+	const char *target;
+	size_t (*writefn)(void*, size_t, size_t, void*);
+	void *writedata;
+	void (*reset)(void*);
+	int (*complete)(void*);
+	long httpcode;
 };
 
 struct task_t {
@@ -208,94 +333,400 @@ struct task_t {
 	void (*printfn)(struct aurpkg_t*);
 };
 
+struct dljob_t {
+	const char *target;
+	char *name;
+	char *urlpath;
+	char *subdir;
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+	struct response_t *response;
+	size_t bytes;
+	long long fetchtime;
+	long long extracttime;
+	int ndeps;
+	int measured;
+	struct dljob_t *next;
+};
+
+struct histogram_t {
+	uint64_t buckets[12];
+	uint64_t count;
+	double sum;
+};
+
+struct metrics_t {
+	uint64_t counters[METRIC_MAX];
+	uint64_t requests[REQUEST_MAX];
+	uint64_t httperrors[200];
+	struct histogram_t latency[REQUEST_MAX];
+	struct histogram_t extract;
+	struct histogram_t phases[PHASE_MAX];
+	struct metrics_t *next;
+};
+
+struct histentry_t {
+	size_t bytes;
+	long long fetchtime;
+	long long extracttime;
+	int ndeps;
+	char name[];
+};
+
+struct loadjob_t {
+	const char **paths;
+	alpm_list_t **depends;
+	size_t count;
+	size_t next;
+};
+
+struct strentry_t {
+	const void *owner;
+	const char *str;
+	size_t len;
+};
+
+struct strset_t {
+	struct strentry_t *entries;
+	size_t size;
+	size_t count;
+};
+
+struct strpool_t {
+	pthread_mutex_t lock;
+	struct strset_t set;
+	alpm_list_t *blocks;
+	char *next;
+	size_t avail;
+};
+
+struct extinfo_t {
+	struct aurpkg_t *pkg;
+	CURL *handle;
+	struct response_t *response;
+	char *url;
+	extinfostate_t state;
+	int attempt;
+	long long due;
+	long long start;
+};
+
+struct stage_t {
+	const char *name;
+	void (*fn)(CURL*, struct dljob_t*);
+	int network;
+	int workers;
+	int capacity;
+	int count;
+	struct dljob_t *head;
+	struct dljob_t *tail;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+};
+
+struct lockstat_t {
+	const char *name;
+	uint64_t acquired;
+	uint64_t contended;
+	long long waittotal;
+	long long waitmax;
+	long long holdtotal;
+	long long holdmax;
+	long long since;
+};
+
 struct openssl_mutex_t {
 	pthread_mutex_t *lock;
 	long *lock_count;
+	struct lockstat_t *stats;
+};
+
+struct limiter_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	double limit;
+	int ceiling;
+	int inflight;
+	double minrtt;
+	long long lastdrop;
+};
+
+struct bucket_t {
+	pthread_mutex_t lock;
+	double rate;
+	double burst;
+	double tokens;
+	long long last;
+};
+
+struct hedgestats_t {
+	pthread_mutex_t lock;
+	double samples[128];
+	int count;
+	int next;
+};
+
+struct client_t {
+	int fd;
+	char *payload;
+	uint32_t len;
+};
+
+struct job_t {
+	struct worker_t *worker;
+	int pipes[2];
+	int finished;
+	int status;
+	char *payload;
+	uint32_t len;
+	alpm_list_t *waiting;
+	char *sent;
+	size_t sentlen;
+};
+
+struct worker_t {
+	pid_t pid;
+	int ctl;
+	struct job_t *job;
 };
 /* }}} */
 
 /* function prototypes {{{ */
 static inline int streq(const char *, const char *);
 static inline int startswith(const char *, const char *);
+static int alpm_db_is_ignored(alpm_db_t*);
 static alpm_list_t *alpm_find_foreign_pkgs(void);
 static alpm_handle_t *alpm_init(void);
+static alpm_handle_t *alpm_load(int);
+static alpm_db_t *alpm_localdb(void);
+static void *alpm_preload(void*);
 static int alpm_pkg_is_foreign(alpm_pkg_t*);
 static const char *alpm_provides_pkg(const char*);
+static void alpm_refresh(void);
+static alpm_list_t *alpm_syncdbs(void);
+static int archive_extract_entry(struct archive*, struct archive_entry*, struct archive*);
 static int archive_extract_file(const struct response_t*, char**);
+static void archive_prune(const char*, alpm_list_t*);
+static int archive_prune_entry(const char*, const struct stat*, int, struct FTW*);
+static int aurpkg_add_detail(struct aurpkg_t*, pkgdetail_t, const char*, size_t);
 static int aurpkg_cmp(const void*, const void*);
+static int aurpkg_rankcmp(const void*, const void*);
+static const char **aurpkg_detail(const struct aurpkg_t*, pkgdetail_t, size_t*);
 static struct aurpkg_t *aurpkg_dup(const struct aurpkg_t*);
 static void aurpkg_free(void*);
 static void aurpkg_free_inner(struct aurpkg_t*);
+static int bucket_acquire(struct bucket_t*);
+static void bucket_refill(struct bucket_t*, long long);
+static int bucket_tryacquire(struct bucket_t*);
+static void cache_hash(const char*, size_t, char*);
+static int cache_init(void);
+static int cache_load(const char*, struct response_t*);
+static char *cache_stamp_read(const char*, const char*);
+static void cache_stamp_write(const char*, const char*, const char*);
+static void cache_store(const char*, const struct response_t*);
+static int cache_write(const char*, const char*, size_t);
+static CURL *curl_handle_get(void);
+static void curl_handle_put(CURL*);
 static CURL *curl_init_easy_handle(CURL*);
-static char *curl_get_url_as_buffer(CURL*, const char*);
+static CURLcode curl_perform(CURL*, struct request_t*);
+static CURLcode curl_perform_hedged(CURL*, struct request_t*);
+static void *curl_warmup(void*);
+static void curl_share_lock(CURL*, curl_lock_data, curl_lock_access, void*);
+static void curl_share_unlock(CURL*, curl_lock_data, void*);
 static size_t curl_write_response(void*, size_t, size_t, void*);
 static int cwr_asprintf(char**, const char*, ...) __attribute__((format(printf,2,3)));
 static int cwr_fprintf(FILE*, loglevel_t, const char*, ...) __attribute__((format(printf,3,4)));
 static int cwr_printf(loglevel_t, const char*, ...) __attribute__((format(printf,2,3)));
 static int cwr_vfprintf(FILE*, loglevel_t, const char*, va_list) __attribute__((format(printf,3,0)));
+static struct client_t *daemon_accept(int, int);
+static int daemon_client(int, char*[]);
+static void daemon_client_free(struct client_t*);
+static int daemon_connect(void);
+static void daemon_dispatch(alpm_list_t**, alpm_list_t*, int);
+static int daemon_execute(const struct client_t*);
+static void daemon_job_free(struct job_t*);
+static int daemon_job_join(struct job_t*, struct client_t*);
+static void daemon_job_send(struct job_t*, unsigned char, const void*, uint32_t);
+static int daemon_send_frame(int, unsigned char, const void*, uint32_t);
+static int daemon_serve(void);
+static int daemon_socket_path(char*, size_t);
+static void daemon_stop(int);
+static void daemon_worker(int);
+static struct worker_t *daemon_worker_start(alpm_list_t*, alpm_list_t*, int);
+static int deps_closure(CURL*);
+static int deps_lookup(const char*, alpm_list_t**);
+static int deps_query(CURL*, alpm_list_t*, alpm_list_t**);
+static char *deps_want(const char*);
+static int doublecmp(const void*, const void*);
 static void *download(CURL *curl, void*);
+static void download_extract(CURL*, struct dljob_t*);
+static void download_fetch(CURL*, struct dljob_t*);
+static void download_resolve(CURL*, struct dljob_t*);
+static void extinfo_add(alpm_list_t**, const char*, size_t, struct strset_t*);
+static void extinfo_seed(struct strset_t*, alpm_list_t**[]);
+static int fd_read_all(int, void*, size_t);
+static int fd_write_all(int, const void*, size_t);
+static void *feed_read(void*);
+static const char *file_map(const char*, size_t*);
+static void file_unmap(const char*, size_t);
+static void filter_free(void);
+static int filter_init(void);
+static int filter_match(const struct aurpkg_t*);
 static alpm_list_t *filter_results(alpm_list_t*);
-static char *get_file_as_buffer(const char*);
 static int getcols(void);
+static void global_cleanup(void);
+static int global_init(void);
+static long long hedge_delay(void);
+static void hedge_record(double);
+static int history_cmp(const void*, const void*);
+static long long history_cost(const char*);
+static void history_free(void);
+static struct histentry_t *history_get(const char*);
+static void history_load(void);
+static alpm_list_t *history_order(alpm_list_t*);
+static void history_record(const struct dljob_t*);
+static void history_save(void);
 static int get_config_path(char *config_path, size_t pathlen);
 static void indentprint(const char*, int);
 static int json_end_map(void*);
+static void json_fputs(const char*, FILE*);
 static int json_integer(void *ctx, long long);
 static int json_map_key(void*, const unsigned char*, size_t);
 static int json_start_map(void*);
 static int json_string(void*, const unsigned char*, size_t);
 static int keycmp(const void *v1, const void *v2);
-static alpm_list_t *load_targets_from_files(alpm_list_t *files);
+static alpm_list_t *limit_results(alpm_list_t*);
+static void limiter_acquire(void);
+static void limiter_release(CURL*, CURLcode);
+static int limiter_tryacquire(void);
+static void lockstat_print(const struct lockstat_t*, int);
+static void lockstat_report(void);
+static void lockstat_reset(void);
+static void load_targets_from_files(alpm_list_t *files);
+static void *load_targets_worker(void*);
+static void metrics_count(metric_t, uint64_t);
+static void metrics_free(void);
+static struct metrics_t *metrics_local(void);
+static void metrics_merge(struct histogram_t*, const struct histogram_t*);
+static void metrics_observe(struct histogram_t*, double);
+static void metrics_phase(phase_t, long long);
+static void metrics_print_histogram(FILE*, const char*, const char*, const char*,
+		const struct histogram_t*);
+static void metrics_request(CURL*, reqtype_t, CURLcode);
+static int metrics_write(void);
+static long long now_usec(void);
 static void openssl_crypto_cleanup(void);
 static void openssl_crypto_init(void);
 static unsigned long openssl_thread_id(void) __attribute__ ((const));
 static void openssl_thread_cb(int, int, const char*, int);
-static alpm_list_t *parse_bash_array(alpm_list_t*, char*, pkgdetail_t);
+static void output_field(FILE*, int*, char, const char*, size_t);
+static void output_integer(FILE*, int*, const char*, long long);
+static void output_list(FILE*, int*, const char*, const struct aurpkg_t*, pkgdetail_t);
+static void output_record(const struct aurpkg_t*);
+static void output_results(alpm_list_t*);
+static void output_string(FILE*, int*, const char*, const char*);
+static void output_u32(FILE*, uint32_t);
+static const char *parse_bash_array(const char*, const char*, alpm_list_t**, pkgdetail_t,
+		struct strset_t*);
 static int parse_configfile(void);
 static int parse_options(int, char*[]);
+static void pipeline_done(struct dljob_t*);
+static void pipeline_enqueue(const char*);
+static void pipeline_push(stage_t, struct dljob_t*);
+static void pipeline_release(void);
+static int pipeline_start(int);
+static void pipeline_stop(void);
 static int pkg_is_binary(const char *pkg);
-static void pkgbuild_get_extinfo(char*, alpm_list_t**[]);
+static void pkgbuild_fetch_extinfo(CURL*, alpm_list_t*);
+static void pkgbuild_get_extinfo(const char*, size_t, alpm_list_t**[]);
+static int pkgbuild_keyword(const char*, size_t);
 static int print_escaped(const char*);
-static void print_extinfo_list(alpm_list_t*, const char*, const char*, int);
+static void print_extinfo_list(const struct aurpkg_t*, pkgdetail_t, const char*, const char*, int);
 static void print_pkg_formatted(struct aurpkg_t*);
 static void print_pkg_info(struct aurpkg_t*);
 static void print_pkg_search(struct aurpkg_t*);
 static void print_results(alpm_list_t*, void (*)(struct aurpkg_t*));
-static int read_targets_from_file(FILE *in, alpm_list_t **targets);
-static int resolve_dependencies(CURL*, const char*, const char*);
+static int read_targets_from_file(FILE *in);
+static int request_is_transient(CURLcode, long);
+static CURLcode request_status(struct request_t*, CURLcode);
+static int resolve_dependencies(const char*, const char*);
+static struct response_t *response_get(void);
+static void response_pool_drain(void);
+static void response_put(struct response_t*);
+static int response_reserve(struct response_t*, size_t);
+static void response_reset(void*);
+static int run_operation(int, char*[]);
 static int set_working_dir(void);
+static void sleep_usec(long long);
+static void *stage_worker(void*);
+static void srcinfo_get_extinfo(const char*, size_t, alpm_list_t**[]);
+static int srcinfo_keyword(const char*, size_t, const char*);
 static int strings_init(void);
 static int string_to_key(const unsigned char *key, size_t len);
+static void strpool_free(void);
+static const char *strpool_intern(const char*, size_t);
+static int strptrcmp(const void*, const void*);
+static int strset_add(struct strset_t*, const void*, const char*, size_t);
+static void strset_free(struct strset_t*);
+static uint32_t strset_hash(const void*, const char*, size_t);
+static const char *strset_lookup(const struct strset_t*, const void*, const char*, size_t);
 static size_t strtrim(char*);
+static int target_add(const char*, size_t);
 static void *task_download(CURL*, void*);
 static void *task_query(CURL*, void*);
 static void *task_update(CURL*, void*);
+static int term_isatty(void);
 static void *thread_pool(void*);
+static void timeline_event(const char*, const char*, long long, const char*);
+static void timeline_lock(pthread_mutex_t*, struct lockstat_t*);
+static void timeline_unlock(pthread_mutex_t*, struct lockstat_t*);
+static void timeline_wait(pthread_cond_t*, pthread_mutex_t*, struct lockstat_t*);
+static alpm_list_t *topk_drain(struct topk_t*);
+static void topk_free(struct topk_t*);
+static void topk_offer(struct topk_t*, struct aurpkg_t*);
+static void trace_request(CURL*, reqtype_t, const char*, CURLcode);
 static char *url_escape(char*, int, const char*);
 static void usage(void);
 static void version(void);
 static size_t yajl_parse_stream(void*, size_t, size_t, void*);
+static int yajl_parser_done(void*);
+static void yajl_parser_reset(void*);
 /* }}} */
 
 /* runtime configuration {{{ */
 static struct {
+	char *cachedir;
 	char *dlpath;
 	const char *delim;
 	const char *format;
+	const char *metricsfile;
+	const char *timeline;
+	const char *tracefile;
 
 	operation_t opmask;
 	loglevel_t logmask;
+	output_t output;
 
 	short color;
 	short ignoreood;
+	short hedge;
+	short incremental;
+	short sortkey;
 	int extinfo:1;
 	int force:1;
 	int getdeps:1;
 	int quiet:1;
 	int skiprepos:1;
 	int frompkgbuild:1;
+	int fromstdin:1;
+	int prune:1;
 	int maxthreads;
+	int limit;
+	int retries;
 	long timeout;
+	long reqtimeout;
+	long deadline;
+	long lowspeedlimit;
+	long lowspeedtime;
 
 	alpm_list_t *targets;
 	struct {
@@ -307,19 +738,151 @@ static struct {
 /* globals {{{ */
 static alpm_handle_t *pmhandle;
 static alpm_db_t *db_local;
+static alpm_list_t *pacman_ignore;
+static struct {
+	pthread_mutex_t lock;
+	int loaded;
+	int failed;
+} alpmstate = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
 static alpm_list_t *workq;
+static struct strset_t targetset;
+static struct strset_t emitted;
+static struct {
+	regex_t *regexes;
+	size_t count;
+	int broken;
+} filters;
+static struct strpool_t strpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static struct {
+	pthread_t thread;
+	FILE *in;
+	int started;
+	int reading;
+	int ret;
+} feed;
+static struct {
+	struct stage_t stages[STAGE_MAX];
+	alpm_list_t *deps;
+	alpm_list_t *depq;
+	alpm_list_t *known;
+	alpm_list_t *missing;
+	pthread_cond_t idle;
+	pthread_t *threads;
+	int nthreads;
+	int busy;
+	int active;
+	int closing;
+	int closure;
+} pipeline = {
+	.stages = {
+		[STAGE_FETCH] = { .ready = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER },
+		[STAGE_EXTRACT] = { .ready = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER },
+		[STAGE_SCAN] = { .ready = PTHREAD_COND_INITIALIZER, .space = PTHREAD_COND_INITIALIZER }
+	},
+	.idle = PTHREAD_COND_INITIALIZER
+};
+static struct {
+	pthread_mutex_t lock;
+	struct strset_t names;
+	alpm_list_t *entries;
+	long long mean;
+	int dirty;
+} history = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static struct {
+	pthread_mutex_t lock;
+	struct metrics_t *threads;
+	int run;
+} metrics = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
 static struct openssl_mutex_t openssl_lock;
 static pthread_mutex_t listlock = PTHREAD_MUTEX_INITIALIZER;
+static struct lockstat_t liststat = { .name = "listlock" };
+static struct lockstat_t alpmstat = { .name = "alpmlock" };
+static struct lockstat_t alpminitstat = { .name = "alpminit" };
+static CURLSH *curlshare;
+static pthread_mutex_t sharelock[CURL_LOCK_DATA_LAST];
+static alpm_list_t *curlpool;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	pthread_mutex_t lock;
+	struct response_t *free[8];
+	int count;
+} bufpool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static FILE *client_stdin;
+static int client_tty = -1;
+static int client_cols;
+static volatile sig_atomic_t daemon_quit;
+static struct limiter_t limiter = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER
+};
+static struct bucket_t rpcbucket = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static struct bucket_t dlbucket = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static struct hedgestats_t hedgestats = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+static long long run_deadline;
+static FILE *timelinefp;
+static long long timeline_epoch;
+static int timeline_events;
+static FILE *tracefp;
+static int worker_count;
+static __thread int worker_id;
+static __thread unsigned int jitter_seed;
+static __thread struct metrics_t *thread_metrics;
+static __thread int thread_metrics_run;
+static __thread char **prune_keep;
+static __thread size_t prune_count;
 
 static const int kUnset = -1;
+static const uint32_t kDaemonMaxRequest = 64 * 1024 * 1024;
+static const char *kDaemonEnv[] = { "HOME", "XDG_CONFIG_HOME" };
+static const int kDaemonWorkers = 4;
 static const int kThreadDefault = 10;
+static const int kThreadCeiling = 32;
+static const int kWarmupConnections = 4;
+static const int kDiskWorkersMax = 4;
+static const int kStageDepth = 2;
+static const size_t kStdinChunk = 64 * 1024;
+static const size_t kStrPoolBlock = 64 * 1024;
+static const size_t kMultiInfoMax = 100;
+static const size_t kMultiInfoUrlMax = 4000;
+static const size_t kBufferMin = 4096;
+static const size_t kBufferRetainMax = 4 * 1024 * 1024;
+static const double kLatencyTolerance = 2.0;
 static const int kInfoIndent = 17;
 static const int kSearchIndent = 4;
 static const int kRegexOpts = REG_ICASE|REG_EXTENDED|REG_NOSUB|REG_NEWLINE;
 static const long kTimeoutDefault = 10;
+static const long kLowSpeedLimitDefault = 1;
+static const long kLowSpeedTimeDefault = 30;
+static const int kRetriesDefault = 2;
+static const long kRetryDelay = 250;
+static const long kRetryDelayMax = 8000;
+static const long long kHedgeDelayDefault = 1000000;
 static const char kListDelim[] = "  ";
 static const char kCowerUserAgent[] = "cower/" COWER_VERSION;
 static const char kRegexChars[] = "^.+*?$[](){}|\\";
+static const char *pkgbuild_keys[] = { "depends", "makedepends", "optdepends",
+                                      "provides", "conflicts", "replaces" };
+static const char *kRequestTypes[] = { "rpc", "pkgbuild", "tarball" };
+static const char *kRequestSpans[] = { "rpc query", "pkgbuild fetch", "tarball download" };
+static const char *kPhases[] = { "setup", "join", "print" };
+static const double kMetricBuckets[] = { 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+                                         1, 2.5, 5, 10 };
 
 static yajl_callbacks callbacks = {
 	NULL,             /* null */
@@ -345,20 +908,27 @@ static const char *aur_cat[] = { NULL, "None", "daemons", "devel", "editors",
 
 static const struct key_t json_keys[] = {
 	{ KEY_CATEGORY, "CategoryID" },
+	{ KEY_CONFLICTS, "Conflicts" },
+	{ KEY_DEPENDS, "Depends" },
 	{ KEY_DESCRIPTION, "Description" },
 	{ KEY_FIRSTSUB, "FirstSubmitted" },
 	{ KEY_ID, "ID" },
 	{ KEY_LASTMOD, "LastModified" },
 	{ KEY_LICENSE, "License" },
 	{ KEY_MAINTAINER, "Maintainer" },
+	{ KEY_MAKEDEPENDS, "MakeDepends" },
 	{ KEY_NAME, "Name" },
 	{ KEY_VOTES, "NumVotes" },
+	{ KEY_OPTDEPENDS, "OptDepends" },
 	{ KEY_OOD, "OutOfDate" },
+	{ KEY_PROVIDES, "Provides" },
+	{ KEY_REPLACES, "Replaces" },
 	{ KEY_URL, "URL" },
 	{ KEY_URLPATH, "URLPath" },
 	{ KEY_VERSION, "Version" },
 	{ KEY_QUERY_RESULTCOUNT, "resultcount" },
-	{ KEY_QUERY_RESULTS, "results" }
+	{ KEY_QUERY_RESULTS, "results" },
+	{ KEY_QUERY_VERSION, "version" }
 };
 
 static struct strings_t colstr = {
@@ -399,6 +969,8 @@ alpm_handle_t *alpm_init(void) /* {{{ */
 		return NULL;
 	}
 
+	db_local = alpm_get_localdb(pmhandle);
+
 	fp = fopen(PACMAN_CONFIG, "r");
 	if(!fp) {
 		return pmhandle;
@@ -419,10 +991,8 @@ alpm_handle_t *alpm_init(void) /* {{{ */
 			section = strndup(&line[1], linelen - 2);
 
 			if(!streq(section, "options")) {
-				if(!cfg.skiprepos && !alpm_list_find_str(cfg.ignore.repos, section)) {
-					alpm_register_syncdb(pmhandle, section, 0);
-					cwr_printf(LOG_DEBUG, "registering alpm db: %s\n", section);
-				}
+				alpm_register_syncdb(pmhandle, section, 0);
+				cwr_printf(LOG_DEBUG, "registering alpm db: %s\n", section);
 			}
 		} else {
 			char *key, *token;
@@ -433,27 +1003,95 @@ alpm_handle_t *alpm_init(void) /* {{{ */
 			strtrim(ptr);
 			if(streq(key, "IgnorePkg")) {
 				for(token = strtok(ptr, "\t\n "); token; token = strtok(NULL, "\t\n ")) {
-					cwr_printf(LOG_DEBUG, "ignoring package: %s\n", token);
-					cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(token));
+					pacman_ignore = alpm_list_add(pacman_ignore, strdup(token));
 				}
 			}
 		}
 	}
 
-	db_local = alpm_get_localdb(pmhandle);
-
 	free(section);
 	fclose(fp);
 
 	return pmhandle;
 } /* }}} */
 
+alpm_handle_t *alpm_load(int caches) /* {{{ */
+{
+	const alpm_list_t *i;
+	long long start;
+
+	/* nothing is loaded until an operation actually asks for it. libalpm fills
+	 * its caches lazily and without locking of its own, so that happens here,
+	 * once, rather than racing in whichever worker gets there first */
+	timeline_lock(&alpmstate.lock, &alpminitstat);
+	if(!pmhandle && !alpmstate.failed) {
+		start = now_usec();
+		if(!alpm_init()) {
+			cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
+			alpmstate.failed = 1;
+		}
+		timeline_event("alpm init", "alpm", start, NULL);
+	}
+
+	caches &= ~alpmstate.loaded;
+	if(pmhandle && (caches & CACHE_LOCALDB)) {
+		start = now_usec();
+		alpm_db_get_pkgcache(db_local);
+		alpmstate.loaded |= CACHE_LOCALDB;
+		timeline_event("load local db", "alpm", start, NULL);
+	}
+	if(pmhandle && (caches & CACHE_SYNCDBS)) {
+		int skipped = 0;
+
+		start = now_usec();
+		for(i = alpm_get_syncdbs(pmhandle); i; i = alpm_list_next(i)) {
+			if(alpm_db_is_ignored(i->data)) {
+				skipped = 1;
+				continue;
+			}
+			alpm_db_get_pkgcache(i->data);
+		}
+		/* a later run in daemon mode might want the repos we skipped */
+		if(!skipped) {
+			alpmstate.loaded |= CACHE_SYNCDBS;
+		}
+		timeline_event("load sync dbs", "alpm", start, NULL);
+	}
+	timeline_unlock(&alpmstate.lock, &alpminitstat);
+
+	return pmhandle;
+} /* }}} */
+
+void *alpm_preload(void *arg) /* {{{ */
+{
+	timeline_lock(&listlock, &liststat);
+	worker_id = ++worker_count;
+	timeline_unlock(&listlock, &liststat);
+
+	timeline_event("alpm loader", NULL, 0, NULL);
+	alpm_load(*(int*)arg);
+
+	return NULL;
+} /* }}} */
+
+alpm_db_t *alpm_localdb(void) /* {{{ */
+{
+	return alpm_load(CACHE_LOCALDB) ? db_local : NULL;
+} /* }}} */
+
+int alpm_db_is_ignored(alpm_db_t *db) /* {{{ */
+{
+	/* every sync db stays registered so a long-lived handle can serve any set
+	 * of --ignorerepo options; the filtering happens at lookup time instead */
+	return cfg.skiprepos || alpm_list_find_str(cfg.ignore.repos, alpm_db_get_name(db));
+} /* }}} */
+
 alpm_list_t *alpm_find_foreign_pkgs(void) /* {{{ */
 {
 	const alpm_list_t *i;
 	alpm_list_t *ret = NULL;
 
-	for(i = alpm_db_get_pkgcache(db_local); i; i = alpm_list_next(i)) {
+	for(i = alpm_db_get_pkgcache(alpm_localdb()); i; i = alpm_list_next(i)) {
 		alpm_pkg_t *pkg = i->data;
 
 		if(alpm_pkg_is_foreign(pkg)) {
@@ -471,8 +1109,8 @@ int alpm_pkg_is_foreign(alpm_pkg_t *pkg) /* {{{ */
 
 	pkgname = alpm_pkg_get_name(pkg);
 
-	for(i = alpm_get_syncdbs(pmhandle); i; i = alpm_list_next(i)) {
-		if(alpm_db_get_pkg(i->data, pkgname)) {
+	for(i = alpm_syncdbs(); i; i = alpm_list_next(i)) {
+		if(!alpm_db_is_ignored(i->data) && alpm_db_get_pkg(i->data, pkgname)) {
 			return 0;
 		}
 	}
@@ -482,34 +1120,163 @@ int alpm_pkg_is_foreign(alpm_pkg_t *pkg) /* {{{ */
 
 const char *alpm_provides_pkg(const char *pkgname) /* {{{ */
 {
-	const alpm_list_t *i;
+	const alpm_list_t *i, *syncdbs;
 	const char *dbname = NULL;
 	static pthread_mutex_t alpmlock = PTHREAD_MUTEX_INITIALIZER;
 
-	pthread_mutex_lock(&alpmlock);
-	for(i = alpm_get_syncdbs(pmhandle); i; i = alpm_list_next(i)) {
+	syncdbs = alpm_syncdbs();
+
+	timeline_lock(&alpmlock, &alpmstat);
+	for(i = syncdbs; i; i = alpm_list_next(i)) {
 		alpm_db_t *db = i->data;
+		if(alpm_db_is_ignored(db)) {
+			continue;
+		}
 		if(alpm_find_satisfier(alpm_db_get_pkgcache(db), pkgname)) {
 			dbname = alpm_db_get_name(db);
 			break;
 		}
 	}
-	pthread_mutex_unlock(&alpmlock);
+	timeline_unlock(&alpmlock, &alpmstat);
 
 	return dbname;
 } /* }}} */
 
+void alpm_refresh(void) /* {{{ */
+{
+	static time_t stamps[3];
+	const char *paths[3] = { PACMAN_CONFIG, PACMAN_DBPATH "/local", PACMAN_DBPATH "/sync" };
+	int i, stale = 0;
+
+	for(i = 0; i < 3; i++) {
+		struct stat st;
+		time_t mtime = stat(paths[i], &st) == 0 ? st.st_mtime : 0;
+
+		if(mtime != stamps[i]) {
+			stamps[i] = mtime;
+			stale = 1;
+		}
+	}
+
+	/* give a failed init another chance on every run */
+	alpmstate.failed = 0;
+
+	if(!pmhandle || !stale) {
+		return;
+	}
+
+	cwr_printf(LOG_DEBUG, "pacman databases changed, reloading alpm\n");
+	alpm_release(pmhandle);
+	FREELIST(pacman_ignore);
+	pmhandle = NULL;
+	db_local = NULL;
+	alpmstate.loaded = 0;
+} /* }}} */
+
+alpm_list_t *alpm_syncdbs(void) /* {{{ */
+{
+	return alpm_load(CACHE_SYNCDBS) ? alpm_get_syncdbs(pmhandle) : NULL;
+} /* }}} */
+
+int archive_extract_entry(struct archive *archive, struct archive_entry *entry, /* {{{ */
+		struct archive *disk)
+{
+	const char *entryname = archive_entry_pathname(entry);
+	size_t size = archive_entry_size(entry), done = 0;
+	struct stat st;
+	char *data, *ondisk;
+	ssize_t n;
+	int fd, ret = ARCHIVE_FATAL;
+
+	/* only regular files which are already on disk with the same size and
+	 * permissions can be left alone */
+	if(!cfg.incremental || archive_entry_filetype(entry) != AE_IFREG ||
+			lstat(entryname, &st) != 0 || !S_ISREG(st.st_mode) ||
+			(size_t)st.st_size != size ||
+			(st.st_mode & 07777) != (archive_entry_perm(entry) & 07777)) {
+		goto extract;
+	}
+
+	if(st.st_mtime == archive_entry_mtime(entry)) {
+		cwr_printf(LOG_DEBUG, "unchanged file: %s\n", entryname);
+		return archive_read_data_skip(archive);
+	}
+
+	if(cfg.incremental < 2) {
+		goto extract;
+	}
+
+	/* same size, different mtime. The data has to come off the archive to
+	 * compare it, so from here on, any write is up to us */
+	data = malloc(size ? size : 1);
+	ondisk = malloc(size ? size : 1);
+	n = 0;
+	while(data && done < size && (n = archive_read_data(archive, data + done, size - done)) > 0) {
+		done += n;
+	}
+
+	/* a failed read has already left its error on the archive */
+	if(!data || !ondisk) {
+		archive_set_error(archive, ENOMEM, "out of memory");
+	} else if(done < size && n >= 0) {
+		archive_set_error(archive, EIO, "truncated entry: %s", entryname);
+	} else if(done == size) {
+		int same = 0;
+
+		if((fd = open(entryname, O_RDONLY|O_CLOEXEC)) >= 0) {
+			same = fd_read_all(fd, ondisk, size) == 0 && memcmp(data, ondisk, size) == 0;
+			close(fd);
+		}
+
+		if(same) {
+			/* the file keeps its mtime, which is the point */
+			cwr_printf(LOG_DEBUG, "unchanged file: %s\n", entryname);
+			ret = ARCHIVE_OK;
+		} else {
+			cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
+			ret = archive_write_header(disk, entry);
+			if(ret == ARCHIVE_OK) {
+				ret = archive_write_data(disk, data, size) < 0 ?
+					ARCHIVE_FATAL : archive_write_finish_entry(disk);
+			}
+			/* the caller looks for the error on the archive being read, as
+			 * archive_read_extract2 leaves it there */
+			if(ret != ARCHIVE_OK) {
+				const char *err = archive_error_string(disk);
+
+				archive_set_error(archive, archive_errno(disk), "%s", err ? err : "write failed");
+			}
+		}
+	}
+
+	free(data);
+	free(ondisk);
+
+	return ret;
+
+extract:
+	cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
+	return archive_read_extract2(archive, entry, disk);
+} /* }}} */
+
 int archive_extract_file(const struct response_t *file, char **subdir) /* {{{ */
 {
-	struct archive *archive;
+	struct archive *archive, *disk;
 	struct archive_entry *entry;
-	const int archive_flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME;
+	const int archive_flags = ARCHIVE_EXTRACT_PERM | ARCHIVE_EXTRACT_TIME |
+		ARCHIVE_EXTRACT_SECURE_NODOTDOT | ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS |
+		ARCHIVE_EXTRACT_SECURE_SYMLINKS;
 	int want_subdir = subdir != NULL, ok, ret = 0;
+	alpm_list_t *extracted = NULL;
 
 	archive = archive_read_new();
 	archive_read_support_filter_all(archive);
 	archive_read_support_format_all(archive);
 
+	disk = archive_write_disk_new();
+	archive_write_disk_set_options(disk, archive_flags);
+	archive_write_disk_set_standard_lookup(disk);
+
 	want_subdir = (subdir != NULL);
 
 	ret = archive_read_open_memory(archive, file->data, file->size);
@@ -526,13 +1293,20 @@ int archive_extract_file(const struct response_t *file, char **subdir) /* {{{ */
 				}
 			}
 
-			cwr_printf(LOG_DEBUG, "extracting file: %s\n", entryname);
+			if(cfg.prune) {
+				extracted = alpm_list_add(extracted, strndup(entryname,
+							strlen(entryname) - (entryname[strlen(entryname) - 1] == '/')));
+			}
 
-			ok = archive_read_extract(archive, entry, archive_flags);
+			ok = archive_extract_entry(archive, entry, disk);
 			/* NOOP ON ARCHIVE_{OK,WARN,RETRY} */
 			if(ok == ARCHIVE_FATAL || ok == ARCHIVE_WARN) {
 				ret = archive_errno(archive);
 				break;
+			} else if(ok == ARCHIVE_FAILED) {
+				/* entries refused for escaping the target dir end up here */
+				cwr_fprintf(stderr, LOG_WARN, "skipping %s: %s\n", entryname,
+						archive_error_string(archive));
 			} else if (ok == ARCHIVE_EOF) {
 				ret = 0;
 				break;
@@ -541,15 +1315,99 @@ int archive_extract_file(const struct response_t *file, char **subdir) /* {{{ */
 		archive_read_close(archive);
 	}
 	archive_read_free(archive);
+	archive_write_free(disk);
 
 	if(want_subdir && *subdir == NULL) {
 		/* massively broken PKGBUILD without a subdir... */
 		*subdir = strdup("");
 	}
 
+	/* only ever prune inside the package's own directory, which is a single
+	 * path component below the target dir */
+	if(cfg.prune && ret == 0 && subdir && **subdir && !strchr(*subdir, '/') &&
+			!streq(*subdir, ".") && !streq(*subdir, "..")) {
+		archive_prune(*subdir, extracted);
+	}
+	FREELIST(extracted);
+
 	return ret;
 } /* }}} */
 
+void archive_prune(const char *root, alpm_list_t *keep) /* {{{ */
+{
+	const alpm_list_t *i;
+	size_t n = 0;
+
+	prune_keep = malloc((alpm_list_count(keep) + 1) * sizeof(char*));
+	if(!prune_keep) {
+		return;
+	}
+	for(i = keep; i; i = alpm_list_next(i)) {
+		prune_keep[n++] = i->data;
+	}
+	qsort(prune_keep, n, sizeof(char*), strptrcmp);
+	prune_count = n;
+
+	nftw(root, archive_prune_entry, 16, FTW_DEPTH|FTW_PHYS);
+
+	free(prune_keep);
+	prune_keep = NULL;
+	prune_count = 0;
+} /* }}} */
+
+int archive_prune_entry(const char *path, const struct stat UNUSED *st, /* {{{ */
+		int type, struct FTW *ftw)
+{
+	if(ftw->level == 0 ||
+			bsearch(&path, prune_keep, prune_count, sizeof(char*), strptrcmp)) {
+		return 0;
+	}
+
+	/* directories still holding something we kept stay put */
+	if(type == FTW_DP ? rmdir(path) == 0 : unlink(path) == 0) {
+		cwr_printf(LOG_DEBUG, "removed stale file: %s\n", path);
+	}
+
+	return 0;
+} /* }}} */
+
+int aurpkg_add_detail(struct aurpkg_t *pkg, pkgdetail_t type, const char *str, /* {{{ */
+		size_t len)
+{
+	const char *interned = strpool_intern(str, len);
+	size_t n, at, count = pkg->detailoff[PKGDETAIL_MAX];
+
+	if(!interned) {
+		return 1;
+	}
+
+	/* two interned strings are only equal if they're one and the same */
+	at = pkg->detailoff[type + 1];
+	for(n = pkg->detailoff[type]; n < at; n++) {
+		if(pkg->details[n] == interned) {
+			return 0;
+		}
+	}
+
+	/* the capacity follows from the count: 4, then doubling */
+	if(count == 0 || (count >= 4 && (count & (count - 1)) == 0)) {
+		const char **details = realloc(pkg->details,
+				(count ? count * 2 : 4) * sizeof(const char*));
+		if(!details) {
+			return 1;
+		}
+		pkg->details = details;
+	}
+
+	memmove(&pkg->details[at + 1], &pkg->details[at], (count - at) * sizeof(const char*));
+	pkg->details[at] = interned;
+	for(n = type + 1; n <= PKGDETAIL_MAX; n++) {
+		pkg->detailoff[n]++;
+	}
+
+	return 0;
+} /* }}} */
+
 int aurpkg_cmp(const void *p1, const void *p2) /* {{{ */
 {
 	const struct aurpkg_t *pkg1 = p1;
@@ -558,6 +1416,41 @@ int aurpkg_cmp(const void *p1, const void *p2) /* {{{ */
 	return strcmp(pkg1->name, pkg2->name);
 } /* }}} */
 
+int aurpkg_rankcmp(const void *p1, const void *p2) /* {{{ */
+{
+	const struct aurpkg_t *pkg1 = p1;
+	const struct aurpkg_t *pkg2 = p2;
+	long long diff = 0;
+
+	/* the best come first: most votes, most recently changed or newest */
+	switch(cfg.sortkey) {
+		case SORT_VOTES:
+			diff = (long long)pkg2->votes - pkg1->votes;
+			break;
+		case SORT_LASTMOD:
+			diff = (long long)pkg2->lastmod - pkg1->lastmod;
+			break;
+		case SORT_FIRSTSUB:
+			diff = (long long)pkg2->firstsub - pkg1->firstsub;
+			break;
+		case SORT_NAME:
+			break;
+	}
+
+	if(diff) {
+		return diff < 0 ? -1 : 1;
+	}
+
+	return strcmp(pkg1->name, pkg2->name);
+} /* }}} */
+
+const char **aurpkg_detail(const struct aurpkg_t *pkg, pkgdetail_t type, size_t *count) /* {{{ */
+{
+	*count = pkg->detailoff[type + 1] - pkg->detailoff[type];
+
+	return *count ? pkg->details + pkg->detailoff[type] : NULL;
+} /* }}} */
+
 struct aurpkg_t *aurpkg_dup(const struct aurpkg_t *pkg) /* {{{ */
 {
 	struct aurpkg_t *newpkg;
@@ -578,73 +1471,284 @@ void aurpkg_free_inner(struct aurpkg_t *pkg) /* {{{ */
 		return;
 	}
 
-	/* free allocated string fields */
+	/* free allocated string fields. The interned ones belong to the pool */
 	free(pkg->name);
-	free(pkg->maint);
 	free(pkg->ver);
 	free(pkg->urlpath);
 	free(pkg->desc);
 	free(pkg->url);
-	free(pkg->lic);
 
 	/* free extended list info */
-	FREELIST(pkg->depends);
-	FREELIST(pkg->makedepends);
-	FREELIST(pkg->optdepends);
-	FREELIST(pkg->provides);
-	FREELIST(pkg->conflicts);
-	FREELIST(pkg->replaces);
+	free(pkg->details);
 
-	memset(pkg, sizeof(struct aurpkg_t), 0);
+	memset(pkg, 0, sizeof(struct aurpkg_t));
 } /* }}} */
 
-int cwr_asprintf(char **string, const char *format, ...) /* {{{ */
+int bucket_acquire(struct bucket_t *bucket) /* {{{ */
 {
-	int ret = 0;
-	va_list args;
+	long long wait = 0, now;
 
-	va_start(args, format);
-	ret = vasprintf(string, format, args);
-	va_end(args);
+	if(bucket->rate <= 0) {
+		return 0;
+	}
 
-	if(ret == -1) {
-		cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+	/* take our token now, even if that leaves the bucket in debt. anyone
+	 * after us then waits until the debt is paid off as well, which keeps
+	 * waiters in order without waking them all at once */
+	pthread_mutex_lock(&bucket->lock);
+	now = now_usec();
+	bucket_refill(bucket, now);
+	bucket->tokens -= 1.0;
+	if(bucket->tokens < 0) {
+		wait = (long long)(-bucket->tokens / bucket->rate * 1000000);
 	}
 
-	return ret;
+	/* a token that only comes due after the deadline is no use to anyone, so
+	 * it goes back and the request fails once the deadline is reached */
+	if(run_deadline && now + wait > run_deadline) {
+		bucket->tokens += 1.0;
+		pthread_mutex_unlock(&bucket->lock);
+		sleep_usec(run_deadline - now);
+		return 1;
+	}
+	pthread_mutex_unlock(&bucket->lock);
+
+	sleep_usec(wait);
+
+	return 0;
 } /* }}} */
 
-int cwr_fprintf(FILE *stream, loglevel_t level, const char *format, ...) /* {{{ */
+void bucket_refill(struct bucket_t *bucket, long long now) /* {{{ */
 {
-	int ret;
-	va_list args;
+	if(bucket->last) {
+		bucket->tokens += (now - bucket->last) / 1e6 * bucket->rate;
+		if(bucket->tokens > bucket->burst) {
+			bucket->tokens = bucket->burst;
+		}
+	} else {
+		bucket->tokens = bucket->burst;
+	}
+	bucket->last = now;
+} /* }}} */
 
-	va_start(args, format);
-	ret = cwr_vfprintf(stream, level, format, args);
-	va_end(args);
+int bucket_tryacquire(struct bucket_t *bucket) /* {{{ */
+{
+	int ret = 0;
+
+	if(bucket->rate <= 0) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+	bucket_refill(bucket, now_usec());
+	if(bucket->tokens >= 1.0) {
+		bucket->tokens -= 1.0;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&bucket->lock);
 
 	return ret;
 } /* }}} */
 
-int cwr_printf(loglevel_t level, const char *format, ...) /* {{{ */
+void cache_hash(const char *in, size_t len, char *key) /* {{{ */
 {
-	int ret;
-	va_list args;
-
-	va_start(args, format);
-	ret = cwr_vfprintf(stdout, level, format, args);
-	va_end(args);
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	int i;
 
-	return ret;
+	SHA256((const unsigned char*)in, len, digest);
+	for(i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		sprintf(&key[i * 2], "%02x", digest[i]);
+	}
 } /* }}} */
 
-int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list args) /* {{{ */
+int cache_init(void) /* {{{ */
 {
-	const char *prefix;
-	char bufout[128];
+	char *resolved, *path;
+	const char *subdirs[] = { "", "/tarballs", "/stamps" };
+	size_t i;
+
+	for(i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+		cwr_asprintf(&path, "%s%s", cfg.cachedir, subdirs[i]);
+		if(mkdir(path, 0755) != 0 && errno != EEXIST) {
+			fprintf(stderr, "error: failed to create cache directory %s: %s\n",
+					path, strerror(errno));
+			free(path);
+			return 1;
+		}
+		free(path);
+	}
 
-	if(!(cfg.logmask & level)) {
-		return 0;
+	/* we're about to chdir into the target dir */
+	resolved = realpath(cfg.cachedir, NULL);
+	if(!resolved) {
+		fprintf(stderr, "error: failed to resolve cache directory %s: %s\n",
+				cfg.cachedir, strerror(errno));
+		return 1;
+	}
+
+	free(cfg.cachedir);
+	cfg.cachedir = resolved;
+
+	return 0;
+} /* }}} */
+
+int cache_load(const char *key, struct response_t *response) /* {{{ */
+{
+	char *path;
+	int fd, ret = 1;
+	struct stat st;
+
+	cwr_asprintf(&path, "%s/tarballs/%s", cfg.cachedir, key);
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	free(path);
+	if(fd < 0) {
+		return 1;
+	}
+
+	if(fstat(fd, &st) == 0 && response_reserve(response, st.st_size + 1) == 0 &&
+			fd_read_all(fd, response->data, st.st_size) == 0) {
+		response->size = st.st_size;
+		response->data[response->size] = '\0';
+		ret = 0;
+	}
+	close(fd);
+
+	return ret;
+} /* }}} */
+
+char *cache_stamp_read(const char *target, const char *key) /* {{{ */
+{
+	char *path, line[PATH_MAX], *subdir = NULL;
+	char name[SHA256_DIGEST_LENGTH * 2 + 1];
+	FILE *fp;
+
+	cwr_asprintf(&path, "%s/%s", cfg.dlpath, target);
+	cache_hash(path, strlen(path), name);
+	free(path);
+
+	cwr_asprintf(&path, "%s/stamps/%s", cfg.cachedir, name);
+	fp = fopen(path, "r");
+	free(path);
+	if(!fp) {
+		return NULL;
+	}
+
+	/* a stamp is the snapshot's key, followed by the subdir it unpacked to */
+	if(fgets(line, sizeof(line), fp) && strtrim(line) && streq(line, key)) {
+		if(!fgets(line, sizeof(line), fp)) {
+			line[0] = '\0';
+		}
+		strtrim(line);
+		subdir = strdup(line);
+	}
+	fclose(fp);
+
+	return subdir;
+} /* }}} */
+
+void cache_stamp_write(const char *target, const char *key, /* {{{ */
+		const char *subdir)
+{
+	char *path, *contents;
+	char name[SHA256_DIGEST_LENGTH * 2 + 1];
+	int len;
+
+	cwr_asprintf(&path, "%s/%s", cfg.dlpath, target);
+	cache_hash(path, strlen(path), name);
+	free(path);
+
+	cwr_asprintf(&path, "%s/stamps/%s", cfg.cachedir, name);
+	len = cwr_asprintf(&contents, "%s\n%s\n", key, subdir ? subdir : "");
+	if(len > 0) {
+		cache_write(path, contents, len);
+		free(contents);
+	}
+	free(path);
+} /* }}} */
+
+void cache_store(const char *key, const struct response_t *response) /* {{{ */
+{
+	char *path;
+
+	cwr_asprintf(&path, "%s/tarballs/%s", cfg.cachedir, key);
+	cache_write(path, response->data, response->size);
+	free(path);
+} /* }}} */
+
+int cache_write(const char *path, const char *data, size_t len) /* {{{ */
+{
+	char *tmp;
+	int fd, ret;
+
+	/* write aside and rename into place, so that concurrent runs never see a
+	 * partial file */
+	cwr_asprintf(&tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if(fd < 0) {
+		cwr_fprintf(stderr, LOG_WARN, "failed to write to cache: %s\n", strerror(errno));
+		free(tmp);
+		return 1;
+	}
+
+	ret = fd_write_all(fd, data, len);
+	close(fd);
+	if(ret != 0 || rename(tmp, path) != 0) {
+		cwr_fprintf(stderr, LOG_WARN, "failed to write to cache: %s\n", strerror(errno));
+		unlink(tmp);
+		ret = 1;
+	}
+	free(tmp);
+
+	return ret;
+} /* }}} */
+
+int cwr_asprintf(char **string, const char *format, ...) /* {{{ */
+{
+	int ret = 0;
+	va_list args;
+
+	va_start(args, format);
+	ret = vasprintf(string, format, args);
+	va_end(args);
+
+	if(ret == -1) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string\n");
+	}
+
+	return ret;
+} /* }}} */
+
+int cwr_fprintf(FILE *stream, loglevel_t level, const char *format, ...) /* {{{ */
+{
+	int ret;
+	va_list args;
+
+	va_start(args, format);
+	ret = cwr_vfprintf(stream, level, format, args);
+	va_end(args);
+
+	return ret;
+} /* }}} */
+
+int cwr_printf(loglevel_t level, const char *format, ...) /* {{{ */
+{
+	int ret;
+	va_list args;
+
+	va_start(args, format);
+	ret = cwr_vfprintf(stdout, level, format, args);
+	va_end(args);
+
+	return ret;
+} /* }}} */
+
+int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list args) /* {{{ */
+{
+	const char *prefix;
+	char bufout[128];
+
+	if(!(cfg.logmask & level)) {
+		return 0;
 	}
 
 	switch(level) {
@@ -672,6 +1776,31 @@ int cwr_vfprintf(FILE *stream, loglevel_t level, const char *format, va_list arg
 	return vfprintf(stream, bufout, args);
 } /* }}} */
 
+CURL *curl_handle_get(void) /* {{{ */
+{
+	CURL *curl = NULL;
+
+	/* handles are kept around between runs so that their connection caches,
+	 * and with them any open connections, survive in daemon mode */
+	pthread_mutex_lock(&poollock);
+	if(curlpool) {
+		alpm_list_t *head = curlpool;
+		curl = head->data;
+		curlpool = alpm_list_remove_item(curlpool, head);
+		free(head);
+	}
+	pthread_mutex_unlock(&poollock);
+
+	return curl ? curl : curl_easy_init();
+} /* }}} */
+
+void curl_handle_put(CURL *curl) /* {{{ */
+{
+	pthread_mutex_lock(&poollock);
+	curlpool = alpm_list_add(curlpool, curl);
+	pthread_mutex_unlock(&poollock);
+} /* }}} */
+
 CURL *curl_init_easy_handle(CURL *handle) /* {{{ */
 {
 	if(!handle) {
@@ -682,492 +1811,2867 @@ CURL *curl_init_easy_handle(CURL *handle) /* {{{ */
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, kCowerUserAgent);
 	curl_easy_setopt(handle, CURLOPT_ENCODING, "deflate, gzip");
 	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, cfg.timeout);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, cfg.lowspeedlimit);
+	curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, cfg.lowspeedtime);
 	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(handle, CURLOPT_SHARE, curlshare);
 
 	/* This is required of multi-threaded apps using timeouts. See
 	 * curl_easy_setopt(3) */
-	if(cfg.timeout > 0L) {
-		curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
-	}
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
 
 	return handle;
 } /* }}} */
 
-char *curl_get_url_as_buffer(CURL *curl, const char *url) /* {{{ */
+CURLcode curl_perform(CURL *curl, struct request_t *req) /* {{{ */
 {
-	long httpcode;
-	struct response_t response = { NULL, 0 };
 	CURLcode curlstat;
+	int attempt;
+	long long start = now_usec();
 
-	curl = curl_init_easy_handle(curl);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_response);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, req->writefn);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, req->writedata);
 
-	cwr_printf(LOG_DEBUG, "get_url_as_buffer: curl_easy_perform %s\n", url);
-	curlstat = curl_easy_perform(curl);
-	if(curlstat != CURLE_OK) {
-		cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", url, curl_easy_strerror(curlstat));
-		goto finish;
-	}
+	for(attempt = 0; ; attempt++) {
+		long timeout = cfg.reqtimeout * 1000, delay;
 
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
-	cwr_printf(LOG_DEBUG, "get_url_as_buffer: %s: server responded with %ld\n", url, httpcode);
-	if(httpcode >= 400) {
-		cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with HTTP %ld\n",
-				url, httpcode);
-	}
+		/* wait for our turn before taking a slot from the limiter, so that a
+		 * rate limited request doesn't keep another one from running */
+		if(bucket_acquire(req->type == REQUEST_RPC ? &rpcbucket : &dlbucket) != 0) {
+			cwr_printf(LOG_DEBUG, "[%s]: run deadline exceeded\n", req->target);
+			curlstat = CURLE_OPERATION_TIMEDOUT;
+			break;
+		}
 
-finish:
-	return response.data;
-} /* }}} */
+		if(run_deadline) {
+			long long remaining = (run_deadline - now_usec()) / 1000;
+			if(remaining <= 0) {
+				cwr_printf(LOG_DEBUG, "[%s]: run deadline exceeded\n", req->target);
+				curlstat = CURLE_OPERATION_TIMEDOUT;
+				break;
+			}
+			if(timeout == 0 || remaining < timeout) {
+				timeout = (long)remaining;
+			}
+		}
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
 
-size_t curl_write_response(void *ptr, size_t size, size_t nmemb, void *stream) /* {{{ */
-{
-	void *newdata;
-	size_t realsize = size * nmemb;
-	struct response_t *mem = stream;
+		req->httpcode = 0;
+		if(req->type == REQUEST_RPC && cfg.hedge) {
+			curlstat = curl_perform_hedged(curl, req);
+		} else {
+			limiter_acquire();
+			curlstat = request_status(req, curl_easy_perform(curl));
+			limiter_release(curl, curlstat);
+			if(tracefp) {
+				trace_request(curl, req->type, req->target, curlstat);
+			}
+			metrics_request(curl, req->type, curlstat);
+			if(curlstat == CURLE_OK) {
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &req->httpcode);
+			}
+		}
 
-	newdata = realloc(mem->data, mem->size + realsize + 1);
-	if(newdata) {
-		mem->data = newdata;
-		memcpy(&(mem->data[mem->size]), ptr, realsize);
-		mem->size += realsize;
-		mem->data[mem->size] = '\0';
-	} else {
-		cwr_fprintf(stderr, LOG_ERROR, "failed to reallocate %zd bytes\n",
-				mem->size + realsize + 1);
-		return 0;
+		if(attempt >= cfg.retries || !request_is_transient(curlstat, req->httpcode)) {
+			break;
+		}
+
+		/* exponential backoff with jitter, so that workers which failed
+		 * together don't all come back at the same moment */
+		delay = kRetryDelay << attempt;
+		if(delay > kRetryDelayMax) {
+			delay = kRetryDelayMax;
+		}
+		delay = delay / 2 + rand_r(&jitter_seed) % (delay / 2 + 1);
+		if(run_deadline && now_usec() + delay * 1000 > run_deadline) {
+			break;
+		}
+
+		cwr_printf(LOG_DEBUG, "[%s]: retrying in %ldms (attempt %d of %d)\n",
+				req->target, delay, attempt + 1, cfg.retries);
+		metrics_count(METRIC_RETRIES, 1);
+		sleep_usec(delay * 1000LL);
+
+		if(req->reset) {
+			req->reset(req->writedata);
+		}
 	}
 
-	return realsize;
+	timeline_event(kRequestSpans[req->type], "net", start, req->target);
+
+	return curlstat;
 } /* }}} */
 
-void *download(CURL *curl, void *arg) /* {{{ */
+CURLcode curl_perform_hedged(CURL *curl, struct request_t *req) /* {{{ */
 {
-	alpm_list_t *queryresult = NULL;
-	struct aurpkg_t *result;
-	CURLcode curlstat;
-	char *url, *escaped, *subdir = NULL;
-	int ret;
-	long httpcode;
-	struct response_t response = { 0, 0 };
+	CURLM *multi;
+	CURLMsg *msg;
+	CURL *hedge = NULL, *winner = NULL;
+	CURLcode curlstat = CURLE_OK;
+	struct response_t *hedgebuf = NULL;
+	long long start = now_usec(), delay = hedge_delay();
+	int running, msgs, curldone = 0, hedgedone = 0;
+
+	multi = curl_multi_init();
+	limiter_acquire();
+	curl_multi_add_handle(multi, curl);
+
+	while(!winner) {
+		long wait = 1000;
+
+		curl_multi_perform(multi, &running);
+		while((msg = curl_multi_info_read(multi, &msgs))) {
+			CURLcode result = msg->data.result;
+
+			if(msg->msg != CURLMSG_DONE) {
+				continue;
+			}
 
-	curl = curl_init_easy_handle(curl);
+			if(msg->easy_handle == curl) {
+				curldone = 1;
+				result = request_status(req, result);
+			} else {
+				hedgedone = 1;
+			}
+			limiter_release(msg->easy_handle, result);
 
-	queryresult = task_query(curl, arg);
-	if(!queryresult) {
-		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-		cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char*)arg);
-		return NULL;
-	}
+			/* take the first success, or a failure once nothing else is left
+			 * that could still succeed */
+			if(result == CURLE_OK || !hedge || (curldone && hedgedone)) {
+				winner = msg->easy_handle;
+				curlstat = result;
+				break;
+			}
+		}
 
-	if(access(arg, F_OK) == 0 && !cfg.force) {
-		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-		cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
-				cfg.dlpath, (const char*)arg);
-		alpm_list_free_inner(queryresult, aurpkg_free);
-		alpm_list_free(queryresult);
-		return NULL;
-	}
+		if(winner) {
+			break;
+		}
 
-	curl_easy_setopt(curl, CURLOPT_ENCODING, "identity"); /* disable compression */
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_response);
+		if(!hedge && !curldone) {
+			long long elapsed = now_usec() - start;
+			if(elapsed < delay) {
+				wait = (long)((delay - elapsed) / 1000) + 1;
+			} else if(limiter_tryacquire()) {
+				/* a hedge is extra traffic, so it has to fit under the rate limit
+				 * without waiting for it, too */
+				if(!bucket_tryacquire(&rpcbucket) || !(hedgebuf = response_get())) {
+					limiter_release(NULL, CURLE_OK);
+					wait = 10;
+				} else {
+					/* the hedge buffers its own response. it only gets replayed
+					 * into the request's sink if it wins */
+					cwr_printf(LOG_DEBUG, "[%s]: hedging request after %lldms\n",
+							req->target, elapsed / 1000);
+					hedge = curl_easy_duphandle(curl);
+					hedgebuf->handle = hedge;
+					curl_easy_setopt(hedge, CURLOPT_WRITEFUNCTION, curl_write_response);
+					curl_easy_setopt(hedge, CURLOPT_WRITEDATA, hedgebuf);
+					curl_multi_add_handle(multi, hedge);
+					continue;
+				}
+			} else {
+				wait = 10;
+			}
+		}
 
-	result = queryresult->data;
-	escaped = url_escape(result->urlpath, 0, "/");
-	cwr_asprintf(&url, AUR_BASE_URL "%s", escaped);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	free(escaped);
+		curl_multi_wait(multi, NULL, 0, wait, NULL);
+	}
 
-	cwr_printf(LOG_DEBUG, "[%s]: curl_easy_perform %s\n", (const char*)arg, url);
-	curlstat = curl_easy_perform(curl);
+	/* whoever lost is cancelled and doesn't tell the limiter anything */
+	if(!curldone) {
+		limiter_release(NULL, CURLE_OK);
+	}
+	if(hedge && !hedgedone) {
+		limiter_release(NULL, CURLE_OK);
+	}
 
-	if(curlstat != CURLE_OK) {
-		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-		cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg, curl_easy_strerror(curlstat));
-		goto finish;
+	if(tracefp) {
+		trace_request(winner, req->type, req->target, curlstat);
 	}
+	metrics_request(winner, req->type, curlstat);
 
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
-	cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", (const char *)arg, httpcode);
+	if(curlstat == CURLE_OK) {
+		curl_easy_getinfo(winner, CURLINFO_RESPONSE_CODE, &req->httpcode);
+		hedge_record((now_usec() - start) / 1e6);
 
-	switch(httpcode) {
-		case 200:
-			break;
-		default:
-			cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-			cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld\n",
-					(const char*)arg, httpcode);
-			goto finish;
+		if(winner == hedge) {
+			cwr_printf(LOG_DEBUG, "[%s]: hedged request won\n", req->target);
+			if(req->reset) {
+				req->reset(req->writedata);
+			}
+			req->writefn(hedgebuf->data, 1, hedgebuf->size, req->writedata);
+		}
 	}
 
-	ret = archive_extract_file(&response, &subdir);
-	if(ret != 0) {
-		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
-		cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball: %s\n",
-				(const char*)arg, strerror(ret));
-		goto finish;
+	curl_multi_remove_handle(multi, curl);
+	if(hedge) {
+		curl_multi_remove_handle(multi, hedge);
+		curl_easy_cleanup(hedge);
 	}
+	curl_multi_cleanup(multi);
+	response_put(hedgebuf);
 
-	cwr_printf(LOG_BRIEF, BRIEF_OK "\t%s\t", result->name);
-	cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
-			colstr.pkg, result->name, colstr.nc, cfg.dlpath);
-
-	if(cfg.getdeps) {
-		resolve_dependencies(curl, arg, subdir);
-	}
+	return curlstat;
+} /* }}} */
 
-finish:
-	free(url);
-	free(response.data);
-	free(subdir);
+void curl_share_lock(CURL UNUSED *handle, curl_lock_data data, /* {{{ */
+		curl_lock_access UNUSED access, void UNUSED *userptr)
+{
+	pthread_mutex_lock(&sharelock[data]);
+} /* }}} */
 
-	return queryresult;
+void curl_share_unlock(CURL UNUSED *handle, curl_lock_data data, /* {{{ */
+		void UNUSED *userptr)
+{
+	pthread_mutex_unlock(&sharelock[data]);
 } /* }}} */
 
-alpm_list_t *filter_results(alpm_list_t *list) /* {{{ */
+void *curl_warmup(void UNUSED *arg) /* {{{ */
 {
-	const alpm_list_t *i, *j;
-	alpm_list_t *filterlist = NULL;
+	CURL *curl;
+	long long start = now_usec();
 
-	if(!(cfg.opmask & OP_SEARCH)) {
-		return list;
+	timeline_lock(&listlock, &liststat);
+	worker_id = ++worker_count;
+	timeline_unlock(&listlock, &liststat);
+	timeline_event("warm-up", NULL, 0, NULL);
+
+	curl = curl_init_easy_handle(curl_handle_get());
+	if(!curl) {
+		return NULL;
 	}
 
-	for(i = cfg.targets; i; i = alpm_list_next(i)) {
-		regex_t regex;
-		const char *targ = i->data;
-		filterlist = NULL;
-
-		if(regcomp(&regex, targ, kRegexOpts) == 0) {
-			for(j = list; j; j = alpm_list_next(j)) {
-				struct aurpkg_t *pkg = j->data;
-				const char *name = pkg->name;
-				const char *desc = pkg->desc;
-
-				if(regexec(&regex, name, 0, 0, 0) != REG_NOMATCH ||
-						regexec(&regex, desc, 0, 0, 0) != REG_NOMATCH) {
-					filterlist = alpm_list_add(filterlist, pkg);
-				} else {
-					aurpkg_free(pkg);
-				}
-			}
-			regfree(&regex);
-		}
+	/* the connection stays in the handle's cache for whichever worker picks
+	 * it out of the pool next. The lookup and the TLS session are shared with
+	 * everyone else */
+	curl_easy_setopt(curl, CURLOPT_URL, AUR_BASE_URL "/");
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+	curl_easy_perform(curl);
+	curl_handle_put(curl);
 
-		/* switcheroo */
-		alpm_list_free(list);
-		list = filterlist;
-	}
+	timeline_event("warm up", "net", start, NULL);
 
-	return alpm_list_msort(filterlist, alpm_list_count(filterlist), aurpkg_cmp);
+	return NULL;
 } /* }}} */
 
-int getcols(void) /* {{{ */
+size_t curl_write_response(void *ptr, size_t size, size_t nmemb, void *stream) /* {{{ */
 {
-	int termwidth = -1;
-	const int default_tty = 80;
-	const int default_notty = 0;
+	size_t realsize = size * nmemb;
+	struct response_t *mem = stream;
 
-	if(!isatty(fileno(stdout))) {
-		return default_notty;
-	}
+	/* on the first write the headers are in, so size the buffer for the
+	 * whole body up front if the server told us how big it is */
+	if(mem->size == 0 && mem->handle) {
+		curl_off_t length = -1;
 
-#ifdef TIOCGSIZE
-	struct ttysize win;
-	if(ioctl(1, TIOCGSIZE, &win) == 0) {
-		termwidth = win.ts_cols;
+		curl_easy_getinfo(mem->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		if(length > 0 && (size_t)length > realsize) {
+			response_reserve(mem, length + 1);
+		}
 	}
-#elif defined(TIOCGWINSZ)
-	struct winsize win;
-	if(ioctl(1, TIOCGWINSZ, &win) == 0) {
-		termwidth = win.ws_col;
+
+	if(response_reserve(mem, mem->size + realsize + 1) != 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to reallocate %zd bytes\n",
+				mem->size + realsize + 1);
+		return 0;
 	}
-#endif
-	return termwidth <= 0 ? default_tty : termwidth;
+
+	memcpy(&(mem->data[mem->size]), ptr, realsize);
+	mem->size += realsize;
+	mem->data[mem->size] = '\0';
+
+	return realsize;
 } /* }}} */
 
-char *get_file_as_buffer(const char *path) /* {{{ */
+struct client_t *daemon_accept(int sockfd, int timeout) /* {{{ */
 {
-	FILE *fp;
-	char *buf;
-	long fsize, nread;
+	int fd;
+	uint32_t len;
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	struct timeval tv = { .tv_sec = 5 };
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	struct client_t *client;
+
+	if(poll(&pfd, 1, timeout) <= 0) {
+		return NULL;
+	}
 
-	fp = fopen(path, "r");
-	if(!fp) {
-		cwr_fprintf(stderr, LOG_ERROR, "error: failed to open %s: %s\n",
-				path, strerror(errno));
+	fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC);
+	if(fd < 0) {
 		return NULL;
 	}
 
-	fseek(fp, 0L, SEEK_END);
-	fsize = ftell(fp);
-	fseek(fp, 0L, SEEK_SET);
+	/* only serve our own user, the socket's permissions notwithstanding */
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+			cred.uid != getuid()) {
+		close(fd);
+		return NULL;
+	}
 
-	buf = calloc(1, (size_t)fsize + 1);
+	/* a client that connects and then stalls shouldn't wedge the daemon, and
+	 * neither should one that stops reading its output */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
 
-	nread = fread(buf, 1, fsize, fp);
-	fclose(fp);
+	if(fd_read_all(fd, &len, sizeof(len)) != 0 || len > kDaemonMaxRequest) {
+		close(fd);
+		return NULL;
+	}
 
-	if(nread < fsize) {
-		cwr_fprintf(stderr, LOG_ERROR, "Failed to read full PKGBUILD\n");
+	client = calloc(1, sizeof(struct client_t));
+	client->fd = fd;
+	client->len = len;
+	client->payload = malloc(len);
+	if(!client->payload || fd_read_all(fd, client->payload, len) != 0) {
+		daemon_client_free(client);
 		return NULL;
 	}
 
-	return buf;
+	return client;
 } /* }}} */
 
-int get_config_path(char *config_path, size_t pathlen) /* {{{ */
+int daemon_client(int argc, char *argv[]) /* {{{ */
 {
-	char *var;
-	struct passwd *pwd;
+	int fd, i, readstdin = 0;
+	char path[PATH_MAX], var[PATH_MAX], buf[BUFSIZ], tty[2], cols[16];
+	char *cwd, *payload = NULL, *in = NULL;
+	size_t inlen = 0, payloadlen = 0;
+	uint32_t len;
+	FILE *fp;
 
-	var = getenv("XDG_CONFIG_HOME");
-	if(var != NULL) {
-		snprintf(config_path, pathlen, "%s/cower/config", var);
-		return 0;
+	fd = daemon_connect();
+	if(fd < 0) {
+		return -1;
 	}
 
-	var = getenv("HOME");
-	if(var != NULL) {
-		snprintf(config_path, pathlen, "%s/.config/cower/config", var);
-		return 0;
+	for(i = 1; i < argc; i++) {
+		if(streq(argv[i], "-")) {
+			readstdin = 1;
+		}
 	}
 
-	pwd = getpwuid(getuid());
-	if(pwd != NULL && pwd->pw_dir != NULL) {
-		snprintf(config_path, pathlen, "%s/.config/cower/config", pwd->pw_dir);
-		return 0;
+	/* stdin is only consumed once we know someone is listening, otherwise it
+	 * would be gone by the time we fall back to doing the work ourselves */
+	if(readstdin) {
+		fp = open_memstream(&in, &inlen);
+		while((len = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+			fwrite(buf, 1, len, fp);
+		}
+		fclose(fp);
+	}
+
+	cwd = getcwd(path, sizeof(path));
+	snprintf(tty, sizeof(tty), "%d", isatty(fileno(stdout)));
+	snprintf(cols, sizeof(cols), "%d", getcols());
+
+	/* the request is a length prefixed list of length prefixed fields: cwd,
+	 * tty, columns, the environment the config is found by, stdin and then
+	 * the arguments themselves. Variables are sent as NAME=value, or as a
+	 * bare NAME when they aren't set */
+	fp = open_memstream(&payload, &payloadlen);
+	len = argc + 3 + sizeof(kDaemonEnv) / sizeof(kDaemonEnv[0]);
+	fwrite(&len, sizeof(len), 1, fp);
+#define PUTFIELD(s, n) do { \
+		len = (n); \
+		fwrite(&len, sizeof(len), 1, fp); \
+		fwrite((s), 1, len, fp); \
+	} while(0)
+	PUTFIELD(cwd ? cwd : "/", strlen(cwd ? cwd : "/"));
+	PUTFIELD(tty, strlen(tty));
+	PUTFIELD(cols, strlen(cols));
+	for(i = 0; i < (int)(sizeof(kDaemonEnv) / sizeof(kDaemonEnv[0])); i++) {
+		const char *val = getenv(kDaemonEnv[i]);
+
+		snprintf(var, sizeof(var), "%s%s%s", kDaemonEnv[i], val ? "=" : "", val ? val : "");
+		PUTFIELD(var, strlen(var));
 	}
+	PUTFIELD(in ? in : "", inlen);
+	for(i = 1; i < argc; i++) {
+		PUTFIELD(argv[i], strlen(argv[i]));
+	}
+#undef PUTFIELD
+	fclose(fp);
+	free(in);
+
+	len = payloadlen;
+	if(fd_write_all(fd, &len, sizeof(len)) != 0 ||
+			fd_write_all(fd, payload, payloadlen) != 0) {
+		fprintf(stderr, "error: failed to send request to cower daemon\n");
+		free(payload);
+		close(fd);
+		return 1;
+	}
+	free(payload);
+
+	/* replay the daemon's output until it tells us how the run went */
+	for(;;) {
+		unsigned char type;
+		char *frame;
+
+		if(fd_read_all(fd, &type, 1) != 0 || fd_read_all(fd, &len, sizeof(len)) != 0) {
+			break;
+		}
+
+		frame = malloc(len ? len : 1);
+		if(!frame || fd_read_all(fd, frame, len) != 0) {
+			free(frame);
+			break;
+		}
+
+		if(type == 0 && len == sizeof(int)) {
+			memcpy(&i, frame, sizeof(int));
+			free(frame);
+			close(fd);
+			return i;
+		}
+
+		fd_write_all(type == 1 ? STDOUT_FILENO : STDERR_FILENO, frame, len);
+		free(frame);
+	}
+
+	fprintf(stderr, "error: lost connection to cower daemon\n");
+	close(fd);
 
 	return 1;
 } /* }}} */
 
-void indentprint(const char *str, int indent) /* {{{ */
+int daemon_connect(void) /* {{{ */
 {
-	wchar_t *wcstr;
-	const wchar_t *p;
-	int len, cidx, cols;
+	int fd;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
 
-	if(!str) {
-		return;
+	if(daemon_socket_path(addr.sun_path, sizeof(addr.sun_path)) != 0) {
+		return -1;
 	}
 
-	cols = getcols();
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		return -1;
+	}
 
-	/* if we're not a tty, print without indenting */
-	if(cols == 0) {
-		fputs(str, stdout);
+	/* refuse to hand our arguments and stdin to someone else's daemon */
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) != 0 ||
+			cred.uid != getuid()) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+} /* }}} */
+
+void daemon_client_free(struct client_t *client) /* {{{ */
+{
+	if(!client) {
 		return;
 	}
 
-	len = strlen(str) + 1;
-	wcstr = calloc(len, sizeof(wchar_t));
-	len = mbstowcs(wcstr, str, len);
-	p = wcstr;
-	cidx = indent;
+	close(client->fd);
+	free(client->payload);
+	free(client);
+} /* }}} */
 
-	if(!p || !len) {
+void daemon_dispatch(alpm_list_t **workers, alpm_list_t *jobs, int sockfd) /* {{{ */
+{
+	alpm_list_t *i, *j;
+	const char *failed = "error: cower daemon failed to run request\n";
+
+	for(i = jobs; i; i = alpm_list_next(i)) {
+		struct job_t *job = i->data;
+		struct worker_t *worker = NULL;
+		int out[2], err[2], fds[2];
+		char cbuf[CMSG_SPACE(sizeof(fds))] = { 0 };
+		struct iovec iov = { .iov_base = &job->len, .iov_len = sizeof(job->len) };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cbuf,
+			.msg_controllen = sizeof(cbuf)
+		};
+		struct cmsghdr *cmsg;
+
+		if(job->worker || job->finished) {
+			continue;
+		}
+
+		/* workers are always tried in the same order, so the first one free
+		 * is also the one that has seen the most use, and the warmest */
+		for(j = *workers; j && !worker; j = alpm_list_next(j)) {
+			if(!((struct worker_t*)j->data)->job) {
+				worker = j->data;
+			}
+		}
+		if(!worker && alpm_list_count(*workers) < (size_t)kDaemonWorkers) {
+			worker = daemon_worker_start(*workers, jobs, sockfd);
+			if(worker) {
+				*workers = alpm_list_add(*workers, worker);
+			}
+		}
+		if(!worker) {
+			/* anything queued runs once someone is free again, unless no one
+			 * ever will be */
+			if(!*workers) {
+				job->status = 1;
+				job->finished = 1;
+				daemon_job_send(job, 2, failed, strlen(failed));
+			}
+			return;
+		}
+
+		if(pipe2(out, O_CLOEXEC) != 0) {
+			goto fail;
+		}
+		if(pipe2(err, O_CLOEXEC) != 0) {
+			close(out[0]);
+			close(out[1]);
+			goto fail;
+		}
+
+		/* the worker gets the request along with somewhere to write its
+		 * output, which reaches us as it's written */
+		fds[0] = out[1];
+		fds[1] = err[1];
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+		if(sendmsg(worker->ctl, &msg, 0) != sizeof(job->len) ||
+				fd_write_all(worker->ctl, job->payload, job->len) != 0) {
+			close(out[0]);
+			close(out[1]);
+			close(err[0]);
+			close(err[1]);
+			goto fail;
+		}
+		close(out[1]);
+		close(err[1]);
+
+		job->pipes[0] = out[0];
+		job->pipes[1] = err[0];
+		job->worker = worker;
+		worker->job = job;
+		continue;
+
+fail:
+		cwr_fprintf(stderr, LOG_ERROR, "failed to start request: %s\n", strerror(errno));
+		job->status = 1;
+		job->finished = 1;
+		daemon_job_send(job, 2, failed, strlen(failed));
+	}
+} /* }}} */
+
+int daemon_execute(const struct client_t *client) /* {{{ */
+{
+	char **fields, **argv, *indata, *eq;
+	const char *ptr = client->payload, *end = client->payload + client->len;
+	const uint32_t nfixed = 4 + sizeof(kDaemonEnv) / sizeof(kDaemonEnv[0]);
+	uint32_t count, len, i;
+	int ret;
+	FILE *in;
+
+	if((size_t)(end - ptr) < sizeof(count)) {
+		goto malformed;
+	}
+	memcpy(&count, ptr, sizeof(count));
+	ptr += sizeof(count);
+	if(count < nfixed || count > client->len) {
+		goto malformed;
+	}
+
+	fields = calloc(count + 1, sizeof(char*));
+	for(i = 0; i < count; i++) {
+		if((size_t)(end - ptr) < sizeof(len)) {
+			break;
+		}
+		memcpy(&len, ptr, sizeof(len));
+		ptr += sizeof(len);
+		if((size_t)(end - ptr) < len) {
+			break;
+		}
+		fields[i] = strndup(ptr, len);
+		ptr += len;
+	}
+
+	if(i != count) {
+		for(i = 0; i < count; i++) {
+			free(fields[i]);
+		}
+		free(fields);
+		goto malformed;
+	}
+
+	/* the last fixed field is the client's stdin, which stands in for our own
+	 * when the targets include '-'. The rest is argv, minus argv[0] */
+	indata = fields[nfixed - 1];
+	argv = fields + nfixed - 1;
+	argv[0] = "cower";
+
+	if(chdir(fields[0]) != 0) {
+		fprintf(stderr, "error: cower daemon failed to run request: %s\n", strerror(errno));
+		ret = 1;
+		goto cleanup;
+	}
+
+	/* the config is looked for relative to the client's environment, not
+	 * whatever the daemon was started with */
+	for(i = 3; i < nfixed - 1; i++) {
+		if((eq = strchr(fields[i], '='))) {
+			*eq = '\0';
+			setenv(fields[i], eq + 1, 1);
+		} else {
+			unsetenv(fields[i]);
+		}
+	}
+
+	client_tty = atoi(fields[1]);
+	client_cols = atoi(fields[2]);
+	in = *indata ? fmemopen(indata, strlen(indata), "r") : fopen("/dev/null", "r");
+	client_stdin = in;
+
+	ret = run_operation(count - nfixed + 1, argv);
+
+	fflush(stdout);
+	fflush(stderr);
+	if(in) {
+		fclose(in);
+	}
+	client_stdin = NULL;
+	client_tty = -1;
+
+cleanup:
+	fields[nfixed - 1] = indata;
+	for(i = 0; i < count; i++) {
+		free(fields[i]);
+	}
+	free(fields);
+
+	return ret;
+
+malformed:
+	fprintf(stderr, "error: malformed request to cower daemon\n");
+	return 1;
+} /* }}} */
+
+void daemon_job_free(struct job_t *job) /* {{{ */
+{
+	alpm_list_t *i;
+
+	if(!job) {
 		return;
 	}
 
-	while(*p) {
-		if(*p == L' ') {
-			const wchar_t *q, *next;
-			p++;
-			if(!p || *p == L' ') {
-				continue;
-			}
-			next = wcschr(p, L' ');
-			if(!next) {
-				next = p + wcslen(p);
-			}
+	for(i = job->waiting; i; i = alpm_list_next(i)) {
+		daemon_client_free(i->data);
+	}
+	alpm_list_free(job->waiting);
+	free(job->payload);
+	if(job->pipes[0] >= 0) {
+		close(job->pipes[0]);
+	}
+	if(job->pipes[1] >= 0) {
+		close(job->pipes[1]);
+	}
+	free(job->sent);
+	free(job);
+} /* }}} */
+
+int daemon_job_join(struct job_t *job, struct client_t *client) /* {{{ */
+{
+	/* whoever turns up late still gets the whole answer */
+	if(job->sentlen && fd_write_all(client->fd, job->sent, job->sentlen) != 0) {
+		daemon_client_free(client);
+		return 1;
+	}
+
+	job->waiting = alpm_list_add(job->waiting, client);
+
+	return 0;
+} /* }}} */
+
+void daemon_job_send(struct job_t *job, unsigned char type, /* {{{ */
+		const void *data, uint32_t len)
+{
+	alpm_list_t *i = job->waiting;
+	size_t framelen = 1 + sizeof(len) + len;
+	char *sent;
+
+	/* keep a copy of every frame, to replay to whoever joins later */
+	sent = realloc(job->sent, job->sentlen + framelen);
+	if(sent) {
+		sent[job->sentlen] = type;
+		memcpy(sent + job->sentlen + 1, &len, sizeof(len));
+		memcpy(sent + job->sentlen + 1 + sizeof(len), data, len);
+		job->sent = sent;
+		job->sentlen += framelen;
+	}
+
+	while(i) {
+		struct client_t *client = i->data;
+		alpm_list_t *next = alpm_list_next(i);
+
+		if(daemon_send_frame(client->fd, type, data, len) != 0) {
+			job->waiting = alpm_list_remove_item(job->waiting, i);
+			free(i);
+			daemon_client_free(client);
+		}
+		i = next;
+	}
+} /* }}} */
+
+int daemon_send_frame(int fd, unsigned char type, const void *data, uint32_t len) /* {{{ */
+{
+	if(fd_write_all(fd, &type, 1) != 0 || fd_write_all(fd, &len, sizeof(len)) != 0 ||
+			fd_write_all(fd, data, len) != 0) {
+		return 1;
+	}
+
+	return 0;
+} /* }}} */
+
+int daemon_serve(void) /* {{{ */
+{
+	int sockfd;
+	alpm_list_t *i, *jobs = NULL, *workers = NULL;
+	struct client_t *client;
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct sigaction sa = { .sa_handler = daemon_stop };
+
+	if(daemon_socket_path(addr.sun_path, sizeof(addr.sun_path)) != 0) {
+		fprintf(stderr, "error: socket path is too long\n");
+		return 1;
+	}
+
+	sockfd = daemon_connect();
+	if(sockfd >= 0) {
+		fprintf(stderr, "error: a cower daemon is already listening on %s\n", addr.sun_path);
+		close(sockfd);
+		return 1;
+	}
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if(sockfd < 0) {
+		fprintf(stderr, "error: failed to create socket: %s\n", strerror(errno));
+		return 1;
+	}
+
+	unlink(addr.sun_path);
+	if(bind(sockfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+			chmod(addr.sun_path, 0600) != 0 || listen(sockfd, SOMAXCONN) != 0) {
+		fprintf(stderr, "error: failed to listen on %s: %s\n", addr.sun_path, strerror(errno));
+		close(sockfd);
+		return 1;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* requests are handed to a few long-lived workers, so that one slow
+	 * request doesn't hold up anyone else while the connections, caches and
+	 * limiters built up by earlier ones stay warm. We relay their output to
+	 * the client as it comes */
+	for(;;) {
+		struct pollfd *pfds;
+		size_t n = 1;
+		int stream;
+
+		if(daemon_quit && sockfd >= 0) {
+			close(sockfd);
+			unlink(addr.sun_path);
+			sockfd = -1;
+		}
+		if(sockfd < 0 && !jobs) {
+			break;
+		}
+
+		daemon_dispatch(&workers, jobs, sockfd);
+
+		pfds = calloc(1 + 2 * alpm_list_count(jobs) + alpm_list_count(workers),
+				sizeof(struct pollfd));
+		pfds[0].fd = sockfd;
+		pfds[0].events = POLLIN;
+		for(i = jobs; i; i = alpm_list_next(i)) {
+			struct job_t *job = i->data;
+
+			for(stream = 0; stream < 2; stream++, n++) {
+				pfds[n].fd = job->pipes[stream];
+				pfds[n].events = POLLIN;
+			}
+		}
+		for(i = workers; i; i = alpm_list_next(i), n++) {
+			pfds[n].fd = ((struct worker_t*)i->data)->ctl;
+			pfds[n].events = POLLIN;
+		}
+
+		if(poll(pfds, n, -1) < 0) {
+			free(pfds);
+			continue;
+		}
+
+		/* workers only speak up to say how a request went, or by going away */
+		n = 1 + 2 * alpm_list_count(jobs);
+		i = workers;
+		while(i) {
+			struct worker_t *worker = i->data;
+			alpm_list_t *next = alpm_list_next(i);
+			int status;
+
+			if(!pfds[n++].revents) {
+				i = next;
+				continue;
+			}
+
+			if(fd_read_all(worker->ctl, &status, sizeof(status)) == 0) {
+				if(worker->job) {
+					worker->job->status = status;
+					worker->job->finished = 1;
+					worker->job->worker = NULL;
+					worker->job = NULL;
+				}
+			} else {
+				const char *msg = "error: cower daemon worker exited unexpectedly\n";
+
+				if(worker->job) {
+					daemon_job_send(worker->job, 2, msg, strlen(msg));
+					worker->job->status = 1;
+					worker->job->finished = 1;
+					worker->job->worker = NULL;
+				}
+				close(worker->ctl);
+				while(waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR);
+				workers = alpm_list_remove_item(workers, i);
+				free(i);
+				free(worker);
+			}
+			i = next;
+		}
+
+		n = 1;
+		i = jobs;
+		while(i) {
+			struct job_t *job = i->data;
+			alpm_list_t *next = alpm_list_next(i);
+
+			for(stream = 0; stream < 2; stream++, n++) {
+				char buf[BUFSIZ];
+				ssize_t len;
+
+				if(!pfds[n].revents) {
+					continue;
+				}
+
+				len = read(job->pipes[stream], buf, sizeof(buf));
+				if(len > 0) {
+					daemon_job_send(job, stream + 1, buf, len);
+				} else if(len == 0 || errno != EINTR) {
+					close(job->pipes[stream]);
+					job->pipes[stream] = -1;
+				}
+			}
+
+			/* done once the worker says so and everything it wrote is out */
+			if(job->finished && job->pipes[0] < 0 && job->pipes[1] < 0) {
+				daemon_job_send(job, 0, &job->status, sizeof(job->status));
+				jobs = alpm_list_remove_item(jobs, i);
+				free(i);
+				daemon_job_free(job);
+			}
+			i = next;
+		}
+
+		if(pfds[0].revents && (client = daemon_accept(sockfd, 0))) {
+			struct job_t *job = NULL;
+
+			/* anyone who asks the same question while it's being answered
+			 * shares the answer rather than starting a run of their own */
+			for(i = jobs; i; i = alpm_list_next(i)) {
+				struct job_t *j = i->data;
+
+				if(j->len == client->len && memcmp(j->payload, client->payload, j->len) == 0) {
+					job = j;
+					break;
+				}
+			}
+
+			if(job) {
+				daemon_job_join(job, client);
+			} else {
+				/* queued until a worker is free */
+				job = calloc(1, sizeof(struct job_t));
+				job->pipes[0] = job->pipes[1] = -1;
+				job->payload = client->payload;
+				job->len = client->len;
+				client->payload = NULL;
+				job->waiting = alpm_list_add(NULL, client);
+				jobs = alpm_list_add(jobs, job);
+			}
+		}
+
+		free(pfds);
+	}
+
+	/* closing a worker's end tells it to go */
+	for(i = workers; i; i = alpm_list_next(i)) {
+		struct worker_t *worker = i->data;
+
+		close(worker->ctl);
+		while(waitpid(worker->pid, NULL, 0) < 0 && errno == EINTR);
+		free(worker);
+	}
+	alpm_list_free(workers);
+
+	return 0;
+} /* }}} */
+
+int daemon_socket_path(char *path, size_t len) /* {{{ */
+{
+	const char *rundir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if(rundir && *rundir) {
+		n = snprintf(path, len, "%s/cower.sock", rundir);
+	} else {
+		n = snprintf(path, len, "/tmp/cower-%d.sock", getuid());
+	}
+
+	return n < 0 || (size_t)n >= len;
+} /* }}} */
+
+void daemon_stop(int UNUSED signum) /* {{{ */
+{
+	daemon_quit = 1;
+} /* }}} */
+
+void daemon_worker(int ctl) /* {{{ */
+{
+	int savedout = dup(STDOUT_FILENO), savederr = dup(STDERR_FILENO);
+
+	/* a worker runs one request at a time, for as long as the daemon is up.
+	 * What a run leaves behind, from pooled connections to the limiters,
+	 * is there for the next one */
+	for(;;) {
+		struct client_t client = { .fd = -1 };
+		int fds[2], status;
+		char cbuf[CMSG_SPACE(sizeof(fds))];
+		struct iovec iov = { .iov_base = &client.len, .iov_len = sizeof(client.len) };
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = cbuf,
+			.msg_controllen = sizeof(cbuf)
+		};
+		struct cmsghdr *cmsg;
+		ssize_t n;
+
+		while((n = recvmsg(ctl, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if(n != sizeof(client.len) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+				cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+			break;
+		}
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		client.payload = malloc(client.len ? client.len : 1);
+		if(!client.payload || fd_read_all(ctl, client.payload, client.len) != 0) {
+			free(client.payload);
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+
+		fflush(stdout);
+		fflush(stderr);
+		dup2(fds[0], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+
+		status = daemon_execute(&client);
+
+		/* putting our own back closes the last copy of the pipes, which
+		 * tells the daemon the output is complete */
+		fflush(stdout);
+		fflush(stderr);
+		dup2(savedout, STDOUT_FILENO);
+		dup2(savederr, STDERR_FILENO);
+		free(client.payload);
+
+		if(fd_write_all(ctl, &status, sizeof(status)) != 0) {
+			break;
+		}
+	}
+
+	close(savedout);
+	close(savederr);
+	close(ctl);
+} /* }}} */
+
+struct worker_t *daemon_worker_start(alpm_list_t *workers, alpm_list_t *jobs, /* {{{ */
+		int sockfd)
+{
+	int sv[2];
+	pid_t pid;
+	alpm_list_t *i, *j;
+	struct worker_t *worker;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, sv) != 0) {
+		return NULL;
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+	pid = fork();
+	if(pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	} else if(pid == 0) {
+		/* nothing of the daemon's own is any business of the worker */
+		if(sockfd >= 0) {
+			close(sockfd);
+		}
+		for(i = workers; i; i = alpm_list_next(i)) {
+			close(((struct worker_t*)i->data)->ctl);
+		}
+		for(i = jobs; i; i = alpm_list_next(i)) {
+			struct job_t *job = i->data;
+
+			close(job->pipes[0]);
+			close(job->pipes[1]);
+			for(j = job->waiting; j; j = alpm_list_next(j)) {
+				close(((struct client_t*)j->data)->fd);
+			}
+		}
+		close(sv[0]);
+
+		daemon_worker(sv[1]);
+		global_cleanup();
+		fflush(stdout);
+		fflush(stderr);
+		_exit(0);
+	}
+
+	close(sv[1]);
+	cwr_printf(LOG_DEBUG, "started daemon worker %d\n", (int)pid);
+
+	worker = calloc(1, sizeof(struct worker_t));
+	worker->pid = pid;
+	worker->ctl = sv[0];
+
+	return worker;
+} /* }}} */
+
+int deps_closure(CURL *curl) /* {{{ */
+{
+	alpm_list_t *i, *j, *wave, *next, *needed = NULL;
+	long long start = now_usec();
+	int ret = 0;
+
+	/* the targets themselves make up the first wave, and each wave's
+	 * dependencies the next one. That's one batched lookup per level of the
+	 * tree, and not a single tarball has to come down for it */
+	wave = alpm_list_copy(cfg.targets);
+	while(wave) {
+		alpm_list_t *found = NULL;
+
+		if(deps_query(curl, wave, &found) != 0) {
+			alpm_list_free_inner(found, aurpkg_free);
+			alpm_list_free(found);
+			ret = 1;
+			break;
+		}
+
+		/* remember what isn't in the AUR, so that it fails without a query */
+		for(i = wave; i; i = alpm_list_next(i)) {
+			for(j = found; j; j = alpm_list_next(j)) {
+				if(streq(((struct aurpkg_t*)j->data)->name, i->data)) {
+					break;
+				}
+			}
+			if(!j) {
+				pipeline.missing = alpm_list_add(pipeline.missing, i->data);
+			}
+		}
+
+		next = NULL;
+		for(i = found; i; i = alpm_list_next(i)) {
+			struct aurpkg_t *pkg = i->data;
+			pkgdetail_t type;
+
+			for(type = PKGDETAIL_DEPENDS; type <= PKGDETAIL_MAKEDEPENDS; type++) {
+				size_t n, count;
+				const char **deps = aurpkg_detail(pkg, type, &count);
+
+				for(n = 0; n < count; n++) {
+					char *name = deps_want(deps[n]);
+					if(name) {
+						cwr_printf(LOG_DEBUG, "%s depends on %s\n", pkg->name, name);
+						next = alpm_list_add(next, name);
+					}
+				}
+			}
+		}
+
+		pipeline.known = alpm_list_join(pipeline.known, found);
+		needed = alpm_list_join(needed, alpm_list_copy(next));
+		alpm_list_free(wave);
+		wave = next;
+	}
+	alpm_list_free(wave);
+
+	if(ret == 0) {
+		for(i = needed; i; i = alpm_list_next(i)) {
+			pipeline_enqueue(i->data);
+		}
+		pipeline.closure = 1;
+	} else {
+		/* fall back to finding dependencies in each snapshot. Nothing may be
+		 * considered seen, or it would never be looked at again */
+		cwr_printf(LOG_DEBUG, "falling back to reading dependencies from snapshots\n");
+		alpm_list_free_inner(pipeline.known, aurpkg_free);
+		alpm_list_free(pipeline.known);
+		alpm_list_free(pipeline.missing);
+		FREELIST(pipeline.deps);
+		pipeline.known = pipeline.missing = NULL;
+		strset_free(&targetset);
+		for(i = cfg.targets; i; i = alpm_list_next(i)) {
+			strset_add(&targetset, NULL, i->data, strlen(i->data));
+		}
+	}
+	alpm_list_free(needed);
+
+	timeline_event("resolve deps", "deps", start, NULL);
+
+	return ret;
+} /* }}} */
+
+int deps_lookup(const char *name, alpm_list_t **result) /* {{{ */
+{
+	alpm_list_t *i;
+	int known = 0;
+
+	*result = NULL;
+
+	/* each package is only downloaded once, so it's handed over for good */
+	timeline_lock(&listlock, &liststat);
+	for(i = pipeline.known; i; i = alpm_list_next(i)) {
+		if(streq(((struct aurpkg_t*)i->data)->name, name)) {
+			*result = alpm_list_add(NULL, i->data);
+			pipeline.known = alpm_list_remove_item(pipeline.known, i);
+			free(i);
+			known = 1;
+			break;
+		}
+	}
+	if(!known) {
+		known = alpm_list_find_str(pipeline.missing, name) != NULL;
+	}
+	timeline_unlock(&listlock, &liststat);
+
+	return known;
+} /* }}} */
+
+int deps_query(CURL *curl, alpm_list_t *names, alpm_list_t **found) /* {{{ */
+{
+	alpm_list_t *i = names;
+	int ret = 0;
+
+	while(i && ret == 0) {
+		CURLcode curlstat;
+		char *url, *escaped;
+		size_t len, count = 0;
+		struct yajl_parser_t *parse_struct;
+		struct request_t req = {
+			.type = REQUEST_RPC,
+			.target = "multiinfo",
+			.writefn = yajl_parse_stream,
+			.reset = yajl_parser_reset,
+			.complete = yajl_parser_done
+		};
+
+		/* as many names as fit comfortably in one URL */
+		url = strdup(AUR_MULTIINFO_URL);
+		len = strlen(url);
+		for(; i && count < kMultiInfoMax && len < kMultiInfoUrlMax; i = alpm_list_next(i)) {
+			char *arg;
+
+			escaped = url_escape(i->data, 0, NULL);
+			len = cwr_asprintf(&arg, "%s&arg[]=%s", url, escaped);
+			curl_free(escaped);
+			free(url);
+			url = arg;
+			count++;
+		}
+
+		parse_struct = calloc(1, sizeof(struct yajl_parser_t));
+		parse_struct->aurpkg = calloc(1, sizeof(struct aurpkg_t));
+		parse_struct->handle = yajl_alloc(&callbacks, NULL, (void*)parse_struct);
+		parse_struct->expect = count;
+		parse_struct->wantversion = 1;
+		req.writedata = parse_struct;
+
+		curl = curl_init_easy_handle(curl);
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+
+		cwr_printf(LOG_DEBUG, "[multiinfo]: curl_easy_perform %s\n", url);
+		curlstat = curl_perform(curl, &req);
+
+		if(curlstat != CURLE_OK) {
+			cwr_fprintf(stderr, LOG_ERROR, "[multiinfo]: %s\n", curl_easy_strerror(curlstat));
+			ret = 1;
+		} else if(req.httpcode >= 400) {
+			cwr_fprintf(stderr, LOG_ERROR, "[multiinfo]: server responded with HTTP %ld\n",
+					req.httpcode);
+			ret = 1;
+		} else {
+			if(!parse_struct->done) {
+				yajl_complete_parse(parse_struct->handle);
+			}
+			if(parse_struct->error) {
+				cwr_fprintf(stderr, LOG_ERROR, "[multiinfo]: query failed: %s\n",
+						parse_struct->error);
+				ret = 1;
+			} else if(parse_struct->version < 5) {
+				/* older servers don't tell us about dependencies at all */
+				cwr_printf(LOG_DEBUG, "[multiinfo]: server speaks RPC version %d\n",
+						parse_struct->version);
+				ret = 1;
+			}
+		}
+
+		if(ret == 0) {
+			*found = alpm_list_join(*found, parse_struct->pkglist);
+		} else {
+			alpm_list_free_inner(parse_struct->pkglist, aurpkg_free);
+			alpm_list_free(parse_struct->pkglist);
+		}
+
+		yajl_free(parse_struct->handle);
+		aurpkg_free_inner(parse_struct->aurpkg);
+		free(parse_struct->aurpkg);
+		free(parse_struct->error);
+		free(parse_struct);
+		free(url);
+	}
+
+	return ret;
+} /* }}} */
+
+char *deps_want(const char *depend) /* {{{ */
+{
+	char *sanitized = strdup(depend);
+	int seen;
+
+	sanitized[strcspn(sanitized, "<>=")] = '\0';
+
+	/* kept apart from the targets, which the lookup workers are still
+	 * walking through */
+	timeline_lock(&listlock, &liststat);
+	seen = !strset_add(&targetset, NULL, sanitized, strlen(sanitized));
+	if(!seen) {
+		pipeline.deps = alpm_list_add(pipeline.deps, sanitized);
+	}
+	timeline_unlock(&listlock, &liststat);
+
+	if(seen) {
+		if(cfg.logmask & LOG_BRIEF &&
+						!alpm_find_satisfier(alpm_db_get_pkgcache(alpm_localdb()), depend)) {
+				cwr_printf(LOG_BRIEF, "S\t%s\n", sanitized);
+		}
+		free(sanitized);
+		return NULL;
+	}
+
+	if(alpm_find_satisfier(alpm_db_get_pkgcache(alpm_localdb()), depend)) {
+		cwr_printf(LOG_DEBUG, "%s is already satisified\n", depend);
+		return NULL;
+	}
+
+	return pkg_is_binary(depend) ? NULL : sanitized;
+} /* }}} */
+
+int doublecmp(const void *v1, const void *v2) /* {{{ */
+{
+	const double *d1 = v1;
+	const double *d2 = v2;
+
+	return (*d1 > *d2) - (*d1 < *d2);
+} /* }}} */
+
+void *download(CURL *curl, void *arg) /* {{{ */
+{
+	alpm_list_t *queryresult = NULL;
+	struct aurpkg_t *result;
+	struct dljob_t *job;
+	char *subdir = NULL;
+	char key[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	curl = curl_init_easy_handle(curl);
+
+	/* with the dependency tree resolved up front, there's nothing to ask */
+	if(!pipeline.closure || !deps_lookup(arg, &queryresult)) {
+		queryresult = task_query(curl, arg);
+	}
+	if(!queryresult) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+		cwr_fprintf(stderr, LOG_ERROR, "no results found for %s\n", (const char*)arg);
+		return NULL;
+	}
+
+	result = queryresult->data;
+
+	/* a snapshot is identified by where it lives and when it last changed. if
+	 * the target already holds this one, there's nothing to do */
+	if(cfg.cachedir) {
+		char *id;
+		int len = cwr_asprintf(&id, "%s%c%ld", result->urlpath, '\0', (long)result->lastmod);
+
+		cache_hash(id, len > 0 ? len : 0, key);
+		free(id);
+
+		if(access(arg, F_OK) == 0 && (subdir = cache_stamp_read(arg, key))) {
+			cwr_printf(LOG_BRIEF, BRIEF_OK "\t%s\t", result->name);
+			cwr_printf(LOG_INFO, "%s%s%s is up to date in %s\n",
+					colstr.pkg, result->name, colstr.nc, cfg.dlpath);
+			if(!cfg.getdeps || pipeline.closure) {
+				free(subdir);
+				return queryresult;
+			}
+		}
+	}
+
+	if(!subdir && access(arg, F_OK) == 0 && !cfg.force) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+		cwr_fprintf(stderr, LOG_ERROR, "`%s/%s' already exists. Use -f to overwrite.\n",
+				cfg.dlpath, (const char*)arg);
+		alpm_list_free_inner(queryresult, aurpkg_free);
+		alpm_list_free(queryresult);
+		return NULL;
+	}
+
+	job = calloc(1, sizeof(struct dljob_t));
+	if(!job) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", (const char*)arg);
+		cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to allocate memory\n", (const char*)arg);
+		free(subdir);
+		return queryresult;
+	}
+	job->target = arg;
+	job->name = strdup(result->name);
+	job->urlpath = strdup(result->urlpath);
+	job->subdir = subdir;
+	job->ndeps = -1;
+	if(cfg.cachedir) {
+		memcpy(job->key, key, sizeof(key));
+	}
+
+	timeline_lock(&listlock, &liststat);
+	pipeline.busy++;
+	timeline_unlock(&listlock, &liststat);
+
+	/* the rest happens in the stages behind us, so that this worker can move
+	 * on to the next lookup. an up to date snapshot only needs its
+	 * dependencies looked at */
+	pipeline_push(subdir ? STAGE_SCAN : STAGE_FETCH, job);
+
+	return queryresult;
+} /* }}} */
+
+void download_extract(CURL UNUSED *curl, struct dljob_t *job) /* {{{ */
+{
+	int ret;
+	long long start;
+	struct metrics_t *m = metrics_local();
+
+	start = now_usec();
+	ret = archive_extract_file(job->response, &job->subdir);
+	job->extracttime = now_usec() - start;
+	timeline_event("extract", "disk", start, job->target);
+	if(m) {
+		metrics_observe(&m->extract, job->extracttime / 1e6);
+	}
+
+	/* the buffer can go back as soon as it's on disk */
+	response_put(job->response);
+	job->response = NULL;
+
+	if(ret != 0) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", job->target);
+		cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to extract tarball: %s\n",
+				job->target, strerror(ret));
+		pipeline_done(job);
+		return;
+	}
+
+	if(cfg.cachedir) {
+		cache_stamp_write(job->target, job->key, job->subdir);
+	}
+	job->measured = 1;
+
+	cwr_printf(LOG_BRIEF, BRIEF_OK "\t%s\t", job->name);
+	cwr_printf(LOG_INFO, "%s%s%s downloaded to %s\n",
+			colstr.pkg, job->name, colstr.nc, cfg.dlpath);
+
+	if(cfg.getdeps && !pipeline.closure) {
+		pipeline_push(STAGE_SCAN, job);
+	} else {
+		pipeline_done(job);
+	}
+} /* }}} */
+
+void download_fetch(CURL *curl, struct dljob_t *job) /* {{{ */
+{
+	CURLcode curlstat;
+	char *url, *escaped;
+	long httpcode;
+	long long start = now_usec();
+	struct request_t req = {
+		.type = REQUEST_TARBALL,
+		.target = job->target,
+		.writefn = curl_write_response,
+		.reset = response_reset
+	};
+
+	job->response = response_get();
+	if(!job->response) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", job->target);
+		cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to allocate response buffer\n",
+				job->target);
+		goto error;
+	}
+
+	if(cfg.cachedir && cache_load(job->key, job->response) == 0) {
+		cwr_printf(LOG_DEBUG, "[%s]: using cached snapshot %s\n", job->target, job->key);
+		metrics_count(METRIC_CACHE_HITS, 1);
+		job->bytes = job->response->size;
+		job->fetchtime = now_usec() - start;
+		pipeline_push(STAGE_EXTRACT, job);
+		return;
+	} else if(cfg.cachedir) {
+		metrics_count(METRIC_CACHE_MISSES, 1);
+	}
+
+	curl = curl_init_easy_handle(curl);
+	if(!curl) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", job->target);
+		cwr_fprintf(stderr, LOG_ERROR, "curl: failed to initialize handle\n");
+		goto error;
+	}
+
+	curl_easy_setopt(curl, CURLOPT_ENCODING, "identity"); /* disable compression */
+
+	escaped = url_escape(job->urlpath, 0, "/");
+	cwr_asprintf(&url, AUR_BASE_URL "%s", escaped);
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	free(escaped);
+
+	job->response->handle = curl;
+	req.writedata = job->response;
+
+	cwr_printf(LOG_DEBUG, "[%s]: curl_easy_perform %s\n", job->target, url);
+	curlstat = curl_perform(curl, &req);
+	free(url);
+
+	if(curlstat != CURLE_OK) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", job->target);
+		cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", job->target, curl_easy_strerror(curlstat));
+		goto error;
+	}
+
+	httpcode = req.httpcode;
+	cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", job->target, httpcode);
+
+	switch(httpcode) {
+		case 200:
+			break;
+		default:
+			cwr_fprintf(stderr, LOG_BRIEF, BRIEF_ERR "\t%s\t", job->target);
+			cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld\n",
+					job->target, httpcode);
+			goto error;
+	}
+
+	if(cfg.cachedir) {
+		cache_store(job->key, job->response);
+	}
+
+	metrics_count(METRIC_DOWNLOADS, 1);
+	job->bytes = job->response->size;
+	job->fetchtime = now_usec() - start;
+	pipeline_push(STAGE_EXTRACT, job);
+	return;
+
+error:
+	pipeline_done(job);
+} /* }}} */
+
+void download_resolve(CURL UNUSED *curl, struct dljob_t *job) /* {{{ */
+{
+	job->ndeps = resolve_dependencies(job->target, job->subdir && *job->subdir ? job->subdir : NULL);
+	pipeline_done(job);
+} /* }}} */
+
+void extinfo_add(alpm_list_t **list, const char *str, size_t len, struct strset_t *seen) /* {{{ */
+{
+	char *entry;
+
+	/* only what's kept gets copied out of the buffer */
+	if(!strset_add(seen, list, str, len)) {
+		return;
+	}
+
+	entry = strndup(str, len);
+	cwr_printf(LOG_DEBUG, "adding depend: %s\n", entry);
+	*list = alpm_list_add(*list, entry);
+} /* }}} */
+
+void extinfo_seed(struct strset_t *seen, alpm_list_t **details[]) /* {{{ */
+{
+	const alpm_list_t *i;
+	int type;
+
+	/* anything already in the lists counts towards the dedupe */
+	for(type = 0; type < PKGDETAIL_MAX; type++) {
+		if(!details[type]) {
+			continue;
+		}
+		for(i = *details[type]; i; i = alpm_list_next(i)) {
+			strset_add(seen, details[type], i->data, strlen(i->data));
+		}
+	}
+} /* }}} */
+
+int fd_read_all(int fd, void *buf, size_t len) /* {{{ */
+{
+	char *ptr = buf;
+
+	while(len > 0) {
+		ssize_t n = read(fd, ptr, len);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n <= 0) {
+			return 1;
+		}
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
+} /* }}} */
+
+
+int fd_write_all(int fd, const void *buf, size_t len) /* {{{ */
+{
+	const char *ptr = buf;
+
+	while(len > 0) {
+		ssize_t n = write(fd, ptr, len);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		} else if(n < 0) {
+			return 1;
+		}
+		ptr += n;
+		len -= n;
+	}
+
+	return 0;
+} /* }}} */
+
+void *feed_read(void UNUSED *arg) /* {{{ */
+{
+	long long start = now_usec();
+
+	feed.ret = read_targets_from_file(feed.in);
+
+	/* wake anyone still waiting on more input */
+	timeline_lock(&listlock, &liststat);
+	feed.reading = 0;
+	pthread_cond_broadcast(&pipeline.idle);
+	timeline_unlock(&listlock, &liststat);
+
+	if(!client_stdin && !freopen(ctermid(NULL), "r", stdin)) {
+		cwr_printf(LOG_DEBUG, "failed to reopen stdin for reading\n");
+	}
+
+	timeline_event("read targets", "stdin", start, NULL);
+
+	return NULL;
+} /* }}} */
+
+const char *file_map(const char *path, size_t *len) /* {{{ */
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "error: failed to open %s: %s\n",
+				path, strerror(errno));
+		return NULL;
+	}
+
+	if(fstat(fd, &st) != 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "error: failed to stat %s: %s\n",
+				path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	/* there's nothing to map, but nothing to parse either */
+	*len = (size_t)st.st_size;
+	if(*len == 0) {
+		close(fd);
+		return "";
+	}
+
+	buf = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(buf == MAP_FAILED) {
+		cwr_fprintf(stderr, LOG_ERROR, "error: failed to map %s: %s\n",
+				path, strerror(errno));
+		return NULL;
+	}
+
+	return buf;
+} /* }}} */
+
+void file_unmap(const char *buf, size_t len) /* {{{ */
+{
+	if(buf && len > 0) {
+		munmap((void*)buf, len);
+	}
+} /* }}} */
+
+void filter_free(void) /* {{{ */
+{
+	size_t n;
+
+	for(n = 0; n < filters.count; n++) {
+		regfree(&filters.regexes[n]);
+	}
+	free(filters.regexes);
+	filters.regexes = NULL;
+	filters.count = 0;
+	filters.broken = 0;
+} /* }}} */
+
+int filter_init(void) /* {{{ */
+{
+	const alpm_list_t *i;
+
+	if(!(cfg.opmask & OP_SEARCH)) {
+		return 0;
+	}
+
+	/* compiled once, and shared by the workers filtering as they go */
+	filters.regexes = calloc(alpm_list_count(cfg.targets), sizeof(regex_t));
+	if(!filters.regexes) {
+		return 1;
+	}
+
+	for(i = cfg.targets; i; i = alpm_list_next(i)) {
+		if(regcomp(&filters.regexes[filters.count], i->data, kRegexOpts) != 0) {
+			/* nothing can match a search which can't be compiled */
+			filters.broken = 1;
+			continue;
+		}
+		filters.count++;
+	}
+
+	return 0;
+} /* }}} */
+
+int filter_match(const struct aurpkg_t *pkg) /* {{{ */
+{
+	size_t n;
+
+	if(!(cfg.opmask & OP_SEARCH)) {
+		return 1;
+	}
+
+	if(filters.broken) {
+		return 0;
+	}
+
+	/* every search term has to match either the name or the description */
+	for(n = 0; n < filters.count; n++) {
+		if(regexec(&filters.regexes[n], pkg->name, 0, 0, 0) == REG_NOMATCH &&
+				regexec(&filters.regexes[n], pkg->desc, 0, 0, 0) == REG_NOMATCH) {
+			return 0;
+		}
+	}
+
+	return 1;
+} /* }}} */
+
+alpm_list_t *filter_results(alpm_list_t *list) /* {{{ */
+{
+	alpm_list_t *i, *filterlist = NULL;
+	long long start;
+
+	if(!(cfg.opmask & OP_SEARCH)) {
+		return list;
+	}
+
+	start = now_usec();
+
+	for(i = list; i; i = alpm_list_next(i)) {
+		struct aurpkg_t *pkg = i->data;
+
+		if(filter_match(pkg)) {
+			filterlist = alpm_list_add(filterlist, pkg);
+		} else {
+			aurpkg_free(pkg);
+		}
+	}
+	alpm_list_free(list);
+
+	timeline_event("filter", "main", start, NULL);
+
+	start = now_usec();
+	filterlist = alpm_list_msort(filterlist, alpm_list_count(filterlist), aurpkg_cmp);
+	timeline_event("sort", "main", start, NULL);
+
+	return filterlist;
+} /* }}} */
+
+int getcols(void) /* {{{ */
+{
+	int termwidth = -1;
+	const int default_tty = 80;
+	const int default_notty = 0;
+
+	if(!term_isatty()) {
+		return default_notty;
+	} else if(client_tty != -1) {
+		return client_cols > 0 ? client_cols : default_tty;
+	}
+
+#ifdef TIOCGSIZE
+	struct ttysize win;
+	if(ioctl(1, TIOCGSIZE, &win) == 0) {
+		termwidth = win.ts_cols;
+	}
+#elif defined(TIOCGWINSZ)
+	struct winsize win;
+	if(ioctl(1, TIOCGWINSZ, &win) == 0) {
+		termwidth = win.ws_col;
+	}
+#endif
+	return termwidth <= 0 ? default_tty : termwidth;
+} /* }}} */
+
+int get_config_path(char *config_path, size_t pathlen) /* {{{ */
+{
+	char *var;
+	struct passwd *pwd;
+
+	var = getenv("XDG_CONFIG_HOME");
+	if(var != NULL) {
+		snprintf(config_path, pathlen, "%s/cower/config", var);
+		return 0;
+	}
+
+	var = getenv("HOME");
+	if(var != NULL) {
+		snprintf(config_path, pathlen, "%s/.config/cower/config", var);
+		return 0;
+	}
+
+	pwd = getpwuid(getuid());
+	if(pwd != NULL && pwd->pw_dir != NULL) {
+		snprintf(config_path, pathlen, "%s/.config/cower/config", pwd->pw_dir);
+		return 0;
+	}
+
+	return 1;
+} /* }}} */
+
+void global_cleanup(void) /* {{{ */
+{
+	alpm_list_t *i;
+
+	for(i = curlpool; i; i = alpm_list_next(i)) {
+		curl_easy_cleanup(i->data);
+	}
+	alpm_list_free(curlpool);
+	curlpool = NULL;
+
+	curl_share_cleanup(curlshare);
+	openssl_crypto_cleanup();
+
+	cwr_printf(LOG_DEBUG, "releasing curl\n");
+	curl_global_cleanup();
+
+	if(pmhandle) {
+		cwr_printf(LOG_DEBUG, "releasing alpm\n");
+		alpm_release(pmhandle);
+	}
+	FREELIST(pacman_ignore);
+} /* }}} */
+
+int global_init(void) /* {{{ */
+{
+	int i;
+
+	cwr_printf(LOG_DEBUG, "initializing curl\n");
+	if(curl_global_init(CURL_GLOBAL_ALL) != 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
+		return 1;
+	}
+	openssl_crypto_init();
+
+	/* DNS lookups and TLS sessions are shared between all handles, so that
+	 * a worker's first request doesn't pay for what another already did */
+	for(i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&sharelock[i], NULL);
+	}
+	curlshare = curl_share_init();
+	curl_share_setopt(curlshare, CURLSHOPT_LOCKFUNC, curl_share_lock);
+	curl_share_setopt(curlshare, CURLSHOPT_UNLOCKFUNC, curl_share_unlock);
+	curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+	return 0;
+} /* }}} */
+
+long long hedge_delay(void) /* {{{ */
+{
+	double sorted[128];
+	int count;
+
+	pthread_mutex_lock(&hedgestats.lock);
+	count = hedgestats.count;
+	memcpy(sorted, hedgestats.samples, count * sizeof(double));
+	pthread_mutex_unlock(&hedgestats.lock);
+
+	/* not enough history to guess at a tail yet */
+	if(count < 20) {
+		return kHedgeDelayDefault;
+	}
+
+	qsort(sorted, count, sizeof(double), doublecmp);
+
+	return (long long)(sorted[count * 95 / 100] * 1000000);
+} /* }}} */
+
+void hedge_record(double latency) /* {{{ */
+{
+	pthread_mutex_lock(&hedgestats.lock);
+	hedgestats.samples[hedgestats.next] = latency;
+	hedgestats.next = (hedgestats.next + 1) % 128;
+	if(hedgestats.count < 128) {
+		hedgestats.count++;
+	}
+	pthread_mutex_unlock(&hedgestats.lock);
+} /* }}} */
+
+int history_cmp(const void *p1, const void *p2) /* {{{ */
+{
+	long long c1 = history_cost(p1), c2 = history_cost(p2);
+	const struct histentry_t *h1, *h2;
+
+	if(c1 != c2) {
+		return c1 > c2 ? -1 : 1;
+	}
+
+	/* the bigger snapshot is the safer bet */
+	h1 = history_get(p1);
+	h2 = history_get(p2);
+	if(h1 && h2 && h1->bytes != h2->bytes) {
+		return h1->bytes > h2->bytes ? -1 : 1;
+	}
+
+	return 0;
+} /* }}} */
+
+long long history_cost(const char *name) /* {{{ */
+{
+	const struct histentry_t *entry = history_get(name);
+
+	/* nothing known is an average job. each dependency is another job that
+	 * can only start once this one is scanned */
+	if(!entry) {
+		return history.mean;
+	}
+
+	return entry->fetchtime + entry->extracttime +
+		(entry->ndeps > 0 ? entry->ndeps : 0) * history.mean;
+} /* }}} */
+
+void history_free(void) /* {{{ */
+{
+	FREELIST(history.entries);
+	strset_free(&history.names);
+	history.mean = 0;
+	history.dirty = 0;
+} /* }}} */
+
+struct histentry_t *history_get(const char *name) /* {{{ */
+{
+	const char *str = strset_lookup(&history.names, NULL, name, strlen(name));
+
+	return str ? (struct histentry_t*)(str - offsetof(struct histentry_t, name)) : NULL;
+} /* }}} */
+
+void history_load(void) /* {{{ */
+{
+	char *path, line[PATH_MAX];
+	FILE *fp;
+
+	cwr_asprintf(&path, "%s/history", cfg.cachedir);
+	fp = fopen(path, "r");
+	free(path);
+	if(!fp) {
+		return;
+	}
+
+	/* one package per line: name, snapshot size, usecs spent fetching and
+	 * extracting it, and the number of dependencies it brought in */
+	while(fgets(line, sizeof(line), fp)) {
+		struct histentry_t *entry;
+		struct histentry_t fields;
+		int namelen;
+
+		if(sscanf(line, "%*s%n %zu %lld %lld %d", &namelen, &fields.bytes,
+					&fields.fetchtime, &fields.extracttime, &fields.ndeps) != 4) {
+			continue;
+		}
+
+		line[namelen] = '\0';
+		if(history_get(line)) {
+			continue;
+		}
+
+		entry = malloc(sizeof(struct histentry_t) + namelen + 1);
+		if(!entry) {
+			break;
+		}
+		*entry = fields;
+		memcpy(entry->name, line, namelen + 1);
+		history.entries = alpm_list_add(history.entries, entry);
+		strset_add(&history.names, NULL, entry->name, namelen);
+	}
+	fclose(fp);
+
+	cwr_printf(LOG_DEBUG, "loaded history for %zu packages\n",
+			alpm_list_count(history.entries));
+} /* }}} */
+
+alpm_list_t *history_order(alpm_list_t *targets) /* {{{ */
+{
+	const alpm_list_t *i;
+	long long total = 0;
+	size_t count = 0;
+
+	for(i = history.entries; i; i = alpm_list_next(i)) {
+		const struct histentry_t *entry = i->data;
+		total += entry->fetchtime + entry->extracttime;
+		count++;
+	}
+	if(!count) {
+		return targets;
+	}
+	history.mean = total / count;
+
+	/* longest first, so that no big job is left running on its own at the
+	 * end while every other worker sits idle */
+	return alpm_list_msort(targets, alpm_list_count(targets), history_cmp);
+} /* }}} */
+
+void history_record(const struct dljob_t *job) /* {{{ */
+{
+	struct histentry_t *entry;
+	size_t len = strlen(job->target);
+
+	pthread_mutex_lock(&history.lock);
+	entry = history_get(job->target);
+	if(entry) {
+		/* averaged in, so that one slow run doesn't reorder everything */
+		entry->fetchtime = (entry->fetchtime + job->fetchtime) / 2;
+		entry->extracttime = (entry->extracttime + job->extracttime) / 2;
+	} else if((entry = malloc(sizeof(struct histentry_t) + len + 1))) {
+		entry->fetchtime = job->fetchtime;
+		entry->extracttime = job->extracttime;
+		entry->ndeps = 0;
+		memcpy(entry->name, job->target, len + 1);
+		history.entries = alpm_list_add(history.entries, entry);
+		strset_add(&history.names, NULL, entry->name, len);
+	}
+	if(entry) {
+		entry->bytes = job->bytes;
+		/* dependencies resolved from the RPC aren't counted per snapshot */
+		if(job->ndeps >= 0) {
+			entry->ndeps = job->ndeps;
+		}
+		history.dirty = 1;
+	}
+	pthread_mutex_unlock(&history.lock);
+} /* }}} */
+
+void history_save(void) /* {{{ */
+{
+	const alpm_list_t *i;
+	char *path, *contents;
+	size_t len;
+	FILE *fp;
+
+	if(!history.dirty) {
+		return;
+	}
+
+	fp = open_memstream(&contents, &len);
+	if(!fp) {
+		return;
+	}
+	for(i = history.entries; i; i = alpm_list_next(i)) {
+		const struct histentry_t *entry = i->data;
+		fprintf(fp, "%s %zu %lld %lld %d\n", entry->name, entry->bytes,
+				entry->fetchtime, entry->extracttime, entry->ndeps);
+	}
+	fclose(fp);
+
+	cwr_asprintf(&path, "%s/history", cfg.cachedir);
+	cache_write(path, contents, len);
+	free(path);
+	free(contents);
+} /* }}} */
+
+void indentprint(const char *str, int indent) /* {{{ */
+{
+	wchar_t *wcstr;
+	const wchar_t *p;
+	int len, cidx, cols;
+
+	if(!str) {
+		return;
+	}
+
+	cols = getcols();
+
+	/* if we're not a tty, print without indenting */
+	if(cols == 0) {
+		fputs(str, stdout);
+		return;
+	}
+
+	len = strlen(str) + 1;
+	wcstr = calloc(len, sizeof(wchar_t));
+	len = mbstowcs(wcstr, str, len);
+	p = wcstr;
+	cidx = indent;
+
+	if(!p || !len) {
+		return;
+	}
+
+	while(*p) {
+		if(*p == L' ') {
+			const wchar_t *q, *next;
+			p++;
+			if(!p || *p == L' ') {
+				continue;
+			}
+			next = wcschr(p, L' ');
+			if(!next) {
+				next = p + wcslen(p);
+			}
+
+			/* len captures # cols */
+			len = 0;
+			q = p;
+
+			while(q < next) {
+				len += wcwidth(*q++);
+			}
+
+			if(len > (cols - cidx - 1)) {
+				/* wrap to a newline and reindent */
+				printf("\n%-*s", indent, "");
+				cidx = indent;
+			} else {
+				fputc(' ', stdout);
+				cidx++;
+			}
+			continue;
+		}
+#ifdef __clang__
+		printf("%lc", *p);
+#else /* assume GCC */
+		printf("%lc", (wint_t)*p);
+#endif
+		cidx += wcwidth(*p);
+		p++;
+	}
+	free(wcstr);
+} /* }}} */
+
+int json_end_map(void *ctx) /* {{{ */
+{
+	struct yajl_parser_t *p = ctx;
+
+	p->json_depth--;
+	if(p->json_depth > 0) {
+		if(p->topk.limit && !(p->aurpkg->ood && cfg.ignoreood)) {
+			/* with a limit, only the best so far are kept at all */
+			struct aurpkg_t *pkg = aurpkg_dup(p->aurpkg);
+			memset(p->aurpkg, 0, sizeof(struct aurpkg_t));
+			if(filter_match(pkg)) {
+				topk_offer(&p->topk, pkg);
+			} else {
+				aurpkg_free(pkg);
+			}
+		} else if(!(p->aurpkg->ood && cfg.ignoreood)) {
+			p->pkglist = alpm_list_add_sorted(p->pkglist, aurpkg_dup(p->aurpkg), aurpkg_cmp);
+			memset(p->aurpkg, 0, sizeof(struct aurpkg_t));
+		} else {
+			aurpkg_free_inner(p->aurpkg);
+		}
+
+		/* once every record we asked for is in, the rest of the body is of
+		 * no use. cancelling here stops the parser and the transfer. servers
+		 * don't agree on where the version goes, so a caller that needs it
+		 * has to read on until it shows up */
+		if(p->expect && ++p->seen >= p->expect && (p->version || !p->wantversion)) {
+			p->done = 1;
+			return 0;
+		}
+	}
+
+	return 1;
+} /* }}} */
+
+void json_fputs(const char *str, FILE *fp) /* {{{ */
+{
+	const unsigned char *p;
+
+	if(!str) {
+		fputs("null", fp);
+		return;
+	}
+
+	fputc('"', fp);
+	for(p = (const unsigned char*)str; *p; p++) {
+		switch(*p) {
+			case '"':
+				fputs("\\\"", fp);
+				break;
+			case '\\':
+				fputs("\\\\", fp);
+				break;
+			case '\n':
+				fputs("\\n", fp);
+				break;
+			case '\t':
+				fputs("\\t", fp);
+				break;
+			default:
+				if(*p < 0x20) {
+					fprintf(fp, "\\u%04x", *p);
+				} else {
+					fputc(*p, fp);
+				}
+				break;
+		}
+	}
+	fputc('"', fp);
+} /* }}} */
+
+int json_integer(void *ctx, long long val) /* {{{ */
+{
+	struct yajl_parser_t *p = ctx;
+
+	switch (p->key) {
+	case KEY_ID:
+		p->aurpkg->id = (int)val;
+		break;
+	case KEY_CATEGORY:
+		p->aurpkg->cat = (int)val;
+		break;
+	case KEY_VOTES:
+		p->aurpkg->votes = (int)val;
+		break;
+	case KEY_OOD:
+		p->aurpkg->ood = (int)val;
+		break;
+	case KEY_FIRSTSUB:
+		p->aurpkg->firstsub = (time_t)val;
+		break;
+	case KEY_LASTMOD:
+		p->aurpkg->lastmod = (time_t)val;
+		break;
+	case KEY_QUERY_RESULTCOUNT:
+		p->resultcount = (int)val;
+		break;
+	case KEY_QUERY_VERSION:
+		p->version = (int)val;
+		break;
+	default:
+		/* ignore other keys */
+		break;
+	}
+
+	return 1;
+} /* }}} */
+
+int json_map_key(void *ctx, const unsigned char *data, size_t size) /* {{{ */
+{
+	struct yajl_parser_t *p = ctx;
+
+	p->key = string_to_key(data, size);
+
+	return 1;
+} /* }}} */
+
+int json_start_map(void *ctx) /* {{{ */
+{
+	struct yajl_parser_t *p = ctx;
+
+	p->json_depth++;
+	if(p->json_depth > 1) {
+		memset(p->aurpkg, 0, sizeof(struct aurpkg_t));
+	}
+
+	return 1;
+} /* }}} */
+
+int json_string(void *ctx, const unsigned char *data, size_t size) /* {{{ */
+{
+	struct yajl_parser_t *p = ctx;
+	char **key = NULL;
+	int type = -1;
+
+	switch(p->key) {
+	case KEY_QUERY_RESULTS:
+		/* usually the AUR returns this as an array. when it shows
+		 * up as a string, it means we have an error. gross. */
+		p->error = strndup((const char*)data, size);
+		return 0;
+	case KEY_NAME:
+		key = &p->aurpkg->name;
+		break;
+	case KEY_MAINTAINER:
+		/* the same few people maintain a lot of packages */
+		p->aurpkg->maint = strpool_intern((const char*)data, size);
+		return p->aurpkg->maint != NULL;
+	case KEY_VERSION:
+		key = &p->aurpkg->ver;
+		break;
+	case KEY_DESCRIPTION:
+		key = &p->aurpkg->desc;
+		break;
+	case KEY_URL:
+		key = &p->aurpkg->url;
+		break;
+	case KEY_URLPATH:
+		key = &p->aurpkg->urlpath;
+		break;
+	case KEY_LICENSE:
+		/* newer versions of the RPC send a list of these */
+		if(p->aurpkg->lic) {
+			char *lic;
+			int len = cwr_asprintf(&lic, "%s %.*s", p->aurpkg->lic, (int)size,
+					(const char*)data);
+			p->aurpkg->lic = strpool_intern(lic, len);
+			free(lic);
+		} else {
+			p->aurpkg->lic = strpool_intern((const char*)data, size);
+		}
+		return p->aurpkg->lic != NULL;
+	case KEY_DEPENDS:
+		type = PKGDETAIL_DEPENDS;
+		break;
+	case KEY_MAKEDEPENDS:
+		type = PKGDETAIL_MAKEDEPENDS;
+		break;
+	case KEY_OPTDEPENDS:
+		type = PKGDETAIL_OPTDEPENDS;
+		break;
+	case KEY_PROVIDES:
+		type = PKGDETAIL_PROVIDES;
+		break;
+	case KEY_CONFLICTS:
+		type = PKGDETAIL_CONFLICTS;
+		break;
+	case KEY_REPLACES:
+		type = PKGDETAIL_REPLACES;
+		break;
+	default:
+		/* ignored other fields */
+		return 1;
+	}
+
+	/* every element of an array arrives here under the array's key */
+	if(type >= 0) {
+		return aurpkg_add_detail(p->aurpkg, type, (const char*)data, size) == 0;
+	}
+
+	*key = strndup((const char*)data, size);
+	if(*key == NULL) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string: %s\n",
+				strerror(errno));
+	}
+
+	return 1;
+} /* }}} */
+
+int keycmp(const void *v1, const void *v2)  /* {{{ */
+{
+	const struct key_t *k1 = v1;
+	const struct key_t *k2 = v2;
+
+	return strcmp(k1->name, k2->name);
+} /* }}} */
+
+alpm_list_t *limit_results(alpm_list_t *list) /* {{{ */
+{
+	alpm_list_t *i;
+	struct topk_t topk = { NULL, 0, 0, 0 };
+	struct strset_t seen = { NULL, 0, 0 };
+	long long start = now_usec();
+
+	/* each query kept only its own best, and the best of those are what's
+	 * left. A package found by more than one search term only counts once */
+	topk.limit = (size_t)cfg.limit;
+	for(i = list; i; i = alpm_list_next(i)) {
+		struct aurpkg_t *pkg = i->data;
+		size_t len = strlen(pkg->name);
+		const char *name;
+
+		/* the heap frees whatever loses, name and all, so the set is keyed
+		 * on a copy that outlives it */
+		name = strpool_intern(pkg->name, len);
+
+		if(name && strset_add(&seen, NULL, name, len)) {
+			topk_offer(&topk, pkg);
+		} else {
+			aurpkg_free(pkg);
+		}
+	}
+	alpm_list_free(list);
+	strset_free(&seen);
+
+	list = topk_drain(&topk);
+	timeline_event("limit", "main", start, NULL);
+
+	return list;
+} /* }}} */
+
+void limiter_acquire(void) /* {{{ */
+{
+	pthread_mutex_lock(&limiter.lock);
+	while(limiter.inflight >= (int)limiter.limit) {
+		pthread_cond_wait(&limiter.cond, &limiter.lock);
+	}
+	limiter.inflight++;
+	pthread_mutex_unlock(&limiter.lock);
+} /* }}} */
+
+void limiter_release(CURL *curl, CURLcode curlstat) /* {{{ */
+{
+	long httpcode = 0;
+	double rtt = 0, backoff = 1.0;
+	long long now = now_usec();
+
+	/* a cancelled request only gives back its slot */
+	if(!curl) {
+		pthread_mutex_lock(&limiter.lock);
+		limiter.inflight--;
+		pthread_cond_broadcast(&limiter.cond);
+		pthread_mutex_unlock(&limiter.lock);
+		return;
+	}
+
+	if(curlstat == CURLE_OK) {
+		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
+		curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &rtt);
+	}
+
+	/* a write error means we aborted the transfer ourselves, which says
+	 * nothing about the health of the server */
+	if(curlstat != CURLE_OK && curlstat != CURLE_WRITE_ERROR) {
+		backoff = 0.5;
+	} else if(httpcode == 429 || httpcode >= 500) {
+		backoff = 0.5;
+	}
+
+	pthread_mutex_lock(&limiter.lock);
+	limiter.inflight--;
+
+	if(rtt > 0 && backoff == 1.0) {
+		/* time to first byte doesn't depend on the size of the body, so every
+		 * kind of request can feed the same estimate of unloaded latency. let
+		 * it creep upwards so that we follow a server that got slower for good */
+		if(limiter.minrtt == 0 || rtt < limiter.minrtt) {
+			limiter.minrtt = rtt;
+		} else {
+			limiter.minrtt += (rtt - limiter.minrtt) * 0.01;
+		}
+
+		if(rtt > limiter.minrtt * kLatencyTolerance) {
+			backoff = 0.8;
+		}
+	}
+
+	if(backoff < 1.0) {
+		/* only back off once per round trip, or a burst of failures from
+		 * requests that were all in flight together collapses the limit */
+		long long window = limiter.minrtt > 0.1 ? limiter.minrtt * 1000000 : 100000;
+		if(now - limiter.lastdrop > window) {
+			limiter.limit *= backoff;
+			if(limiter.limit < 1.0) {
+				limiter.limit = 1.0;
+			}
+			limiter.lastdrop = now;
+			cwr_printf(LOG_DEBUG, "decreasing concurrency limit to %d\n",
+					(int)limiter.limit);
+		}
+	} else if(limiter.inflight + 1 >= (int)limiter.limit &&
+			limiter.limit < limiter.ceiling) {
+		/* additive increase of one per window's worth of successes, but only
+		 * when we're actually using what we already have */
+		int prev = (int)limiter.limit;
+		limiter.limit += 1.0 / limiter.limit;
+		if(limiter.limit > limiter.ceiling) {
+			limiter.limit = limiter.ceiling;
+		}
+		if((int)limiter.limit != prev) {
+			cwr_printf(LOG_DEBUG, "increasing concurrency limit to %d\n",
+					(int)limiter.limit);
+		}
+	}
+
+	pthread_cond_broadcast(&limiter.cond);
+	pthread_mutex_unlock(&limiter.lock);
+} /* }}} */
+
+int limiter_tryacquire(void) /* {{{ */
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&limiter.lock);
+	if(limiter.inflight < (int)limiter.limit) {
+		limiter.inflight++;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&limiter.lock);
+
+	return ret;
+} /* }}} */
+
+void lockstat_print(const struct lockstat_t *stat, int index) /* {{{ */
+{
+	char name[32];
+
+	if(!stat->acquired) {
+		return;
+	}
+
+	if(index >= 0) {
+		snprintf(name, sizeof(name), "%s %d", stat->name, index);
+	} else {
+		snprintf(name, sizeof(name), "%s", stat->name);
+	}
+
+	cwr_printf(LOG_DEBUG, "  %-12s %8" PRIu64 " acquired %8" PRIu64 " contended  "
+			"wait %.3fms (max %.3fms)  held %.3fms (max %.3fms)\n", name,
+			stat->acquired, stat->contended, stat->waittotal / 1e3, stat->waitmax / 1e3,
+			stat->holdtotal / 1e3, stat->holdmax / 1e3);
+} /* }}} */
+
+void lockstat_report(void) /* {{{ */
+{
+	int i;
+
+	cwr_printf(LOG_DEBUG, "lock contention:\n");
+	lockstat_print(&liststat, -1);
+	lockstat_print(&alpmstat, -1);
+	lockstat_print(&alpminitstat, -1);
+	if(openssl_lock.stats) {
+		for(i = 0; i < CRYPTO_num_locks(); i++) {
+			lockstat_print(&openssl_lock.stats[i], i);
+		}
+	}
+} /* }}} */
+
+void lockstat_reset(void) /* {{{ */
+{
+	int i;
+
+	/* a daemon counts each request on its own */
+	memset(&liststat, 0, sizeof(struct lockstat_t));
+	liststat.name = "listlock";
+	memset(&alpmstat, 0, sizeof(struct lockstat_t));
+	alpmstat.name = "alpmlock";
+	memset(&alpminitstat, 0, sizeof(struct lockstat_t));
+	alpminitstat.name = "alpminit";
+	if(openssl_lock.stats) {
+		memset(openssl_lock.stats, 0, CRYPTO_num_locks() * sizeof(struct lockstat_t));
+		for(i = 0; i < CRYPTO_num_locks(); i++) {
+			openssl_lock.stats[i].name = "openssl";
+		}
+	}
+} /* }}} */
+
+void load_targets_from_files(alpm_list_t *files) /* {{{ */
+{
+	alpm_list_t *i;
+	pthread_t *threads;
+	struct loadjob_t job = { NULL, NULL, 0, 0 };
+	int n, nthreads, spawned = 0;
+	size_t f;
+
+	job.count = alpm_list_count(files);
+	job.paths = calloc(job.count, sizeof(const char*));
+	job.depends = calloc(job.count, sizeof(alpm_list_t*));
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = nthreads < 1 ? 1 : (size_t)nthreads > job.count ? (int)job.count : nthreads;
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if(!job.paths || !job.depends || !threads) {
+		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for PKGBUILDs\n");
+		goto cleanup;
+	}
+
+	for(f = 0, i = files; i; i = i->next) {
+		job.paths[f++] = i->data;
+	}
 
-			/* len captures # cols */
-			len = 0;
-			q = p;
+	/* files are parsed in parallel, one per core, and this thread takes its
+	 * share of them too */
+	for(n = 1; n < nthreads; n++) {
+		if(pthread_create(&threads[spawned], NULL, load_targets_worker, &job) == 0) {
+			spawned++;
+		}
+	}
+	load_targets_worker(&job);
+	for(n = 0; n < spawned; n++) {
+		pthread_join(threads[n], NULL);
+	}
 
-			while(q < next) {
-				len += wcwidth(*q++);
-			}
+	/* merged in order of the files given, so that the targets come out the
+	 * same however the parsing was spread out */
+	for(f = 0; f < job.count; f++) {
+		for(i = job.depends[f]; i; i = i->next) {
+			const char *depend = i->data;
 
-			if(len > (cols - cidx - 1)) {
-				/* wrap to a newline and reindent */
-				printf("\n%-*s", indent, "");
-				cidx = indent;
-			} else {
-				fputc(' ', stdout);
-				cidx++;
-			}
-			continue;
+			target_add(depend, strcspn(depend, "<>="));
 		}
-#ifdef __clang__
-		printf("%lc", *p);
-#else /* assume GCC */
-		printf("%lc", (wint_t)*p);
-#endif
-		cidx += wcwidth(*p);
-		p++;
+		FREELIST(job.depends[f]);
 	}
-	free(wcstr);
+
+cleanup:
+	free(threads);
+	free(job.depends);
+	free(job.paths);
+	FREELIST(files);
 } /* }}} */
 
-int json_end_map(void *ctx) /* {{{ */
+void *load_targets_worker(void *arg) /* {{{ */
 {
-	struct yajl_parser_t *p = ctx;
+	struct loadjob_t *job = arg;
 
-	p->json_depth--;
-	if(p->json_depth > 0) {
-		if(!(p->aurpkg->ood && cfg.ignoreood)) {
-			p->pkglist = alpm_list_add_sorted(p->pkglist, aurpkg_dup(p->aurpkg), aurpkg_cmp);
+	while(1) {
+		const char *path, *slash, *buf;
+		char *srcinfo;
+		struct stat pbst, sist;
+		size_t f, len = 0;
+		int usesrcinfo;
+
+		timeline_lock(&listlock, &liststat);
+		f = job->next++;
+		timeline_unlock(&listlock, &liststat);
+		if(f >= job->count) {
+			break;
+		}
+
+		alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+			&job->depends[f], &job->depends[f], NULL, NULL, NULL
+		};
+
+		/* a .SRCINFO next to the PKGBUILD is only trusted if it's no older */
+		path = job->paths[f];
+		slash = strrchr(path, '/');
+		cwr_asprintf(&srcinfo, "%.*s.SRCINFO", slash ? (int)(slash - path + 1) : 0, path);
+		usesrcinfo = stat(path, &pbst) == 0 && stat(srcinfo, &sist) == 0 &&
+				sist.st_mtime >= pbst.st_mtime;
+
+		cwr_printf(LOG_DEBUG, "Parsing %s for extended info\n", usesrcinfo ? srcinfo : path);
+		buf = file_map(usesrcinfo ? srcinfo : path, &len);
+		if(usesrcinfo) {
+			srcinfo_get_extinfo(buf, len, pkg_details);
 		} else {
-			aurpkg_free_inner(p->aurpkg);
+			pkgbuild_get_extinfo(buf, len, pkg_details);
 		}
+		file_unmap(buf, len);
+		free(srcinfo);
 	}
 
-	return 1;
+	return NULL;
 } /* }}} */
 
-int json_integer(void *ctx, long long val) /* {{{ */
+void metrics_count(metric_t id, uint64_t n) /* {{{ */
 {
-	struct yajl_parser_t *p = ctx;
+	struct metrics_t *m = metrics_local();
 
-	switch (p->key) {
-	case KEY_ID:
-		p->aurpkg->id = (int)val;
-		break;
-	case KEY_CATEGORY:
-		p->aurpkg->cat = (int)val;
-		break;
-	case KEY_VOTES:
-		p->aurpkg->votes = (int)val;
-		break;
-	case KEY_OOD:
-		p->aurpkg->ood = (int)val;
-		break;
-	case KEY_FIRSTSUB:
-		p->aurpkg->firstsub = (time_t)val;
-		break;
-	case KEY_LASTMOD:
-		p->aurpkg->lastmod = (time_t)val;
-		break;
-	case KEY_QUERY_RESULTCOUNT:
-		p->resultcount = (int)val;
-		break;
-	default:
-		/* ignore other keys */
-		break;
+	if(m) {
+		m->counters[id] += n;
 	}
+} /* }}} */
 
-	return 1;
+void metrics_free(void) /* {{{ */
+{
+	struct metrics_t *m, *next;
+
+	for(m = metrics.threads; m; m = next) {
+		next = m->next;
+		free(m);
+	}
+	metrics.threads = NULL;
+
+	/* whatever a thread still points at belongs to a run that's over */
+	metrics.run++;
 } /* }}} */
 
-int json_map_key(void *ctx, const unsigned char *data, size_t size) /* {{{ */
+struct metrics_t *metrics_local(void) /* {{{ */
 {
-	struct yajl_parser_t *p = ctx;
+	if(!cfg.metricsfile) {
+		return NULL;
+	}
 
-	p->key = string_to_key(data, size);
+	/* each thread counts into its own block, so the lock is only taken once
+	 * per thread to hang it where metrics_write can find it */
+	if(!thread_metrics || thread_metrics_run != metrics.run) {
+		thread_metrics = calloc(1, sizeof(struct metrics_t));
+		thread_metrics_run = metrics.run;
+		if(thread_metrics) {
+			pthread_mutex_lock(&metrics.lock);
+			thread_metrics->next = metrics.threads;
+			metrics.threads = thread_metrics;
+			pthread_mutex_unlock(&metrics.lock);
+		}
+	}
 
-	return 1;
+	return thread_metrics;
 } /* }}} */
 
-int json_start_map(void *ctx) /* {{{ */
+void metrics_merge(struct histogram_t *into, const struct histogram_t *from) /* {{{ */
 {
-	struct yajl_parser_t *p = ctx;
+	size_t n;
 
-	p->json_depth++;
-	if(p->json_depth > 1) {
-		memset(p->aurpkg, 0, sizeof(struct aurpkg_t));
+	for(n = 0; n < sizeof(into->buckets) / sizeof(into->buckets[0]); n++) {
+		into->buckets[n] += from->buckets[n];
 	}
+	into->count += from->count;
+	into->sum += from->sum;
+} /* }}} */
 
-	return 1;
+void metrics_observe(struct histogram_t *hist, double value) /* {{{ */
+{
+	size_t n, nbounds = sizeof(kMetricBuckets) / sizeof(kMetricBuckets[0]);
+
+	/* the last bucket is +Inf. counts are only made cumulative on output */
+	for(n = 0; n < nbounds && value > kMetricBuckets[n]; n++);
+	hist->buckets[n]++;
+	hist->count++;
+	hist->sum += value;
 } /* }}} */
 
-int json_string(void *ctx, const unsigned char *data, size_t size) /* {{{ */
+void metrics_phase(phase_t phase, long long usec) /* {{{ */
 {
-	struct yajl_parser_t *p = ctx;
-	char **key = NULL;
+	struct metrics_t *m = metrics_local();
 
-	switch(p->key) {
-	case KEY_QUERY_RESULTS:
-		/* usually the AUR returns this as an array. when it shows
-		 * up as a string, it means we have an error. gross. */
-		p->error = strndup((const char*)data, size);
-		return 0;
-	case KEY_NAME:
-		key = &p->aurpkg->name;
-		break;
-	case KEY_MAINTAINER:
-		key = &p->aurpkg->maint;
-		break;
-	case KEY_VERSION:
-		key = &p->aurpkg->ver;
-		break;
-	case KEY_DESCRIPTION:
-		key = &p->aurpkg->desc;
-		break;
-	case KEY_URL:
-		key = &p->aurpkg->url;
-		break;
-	case KEY_URLPATH:
-		key = &p->aurpkg->urlpath;
-		break;
-	case KEY_LICENSE:
-		key = &p->aurpkg->lic;
-		break;
-	default:
-		/* ignored other fields */
-		return 1;
+	if(m) {
+		metrics_observe(&m->phases[phase], usec / 1e6);
 	}
+} /* }}} */
 
-	*key = strndup((const char*)data, size);
-	if(*key == NULL) {
-		cwr_fprintf(stderr, LOG_ERROR, "failed to allocate string: %s\n",
-				strerror(errno));
+void metrics_print_histogram(FILE *fp, const char *name, const char *label, /* {{{ */
+		const char *value, const struct histogram_t *hist)
+{
+	size_t n, nbounds = sizeof(kMetricBuckets) / sizeof(kMetricBuckets[0]);
+	uint64_t cumulative = 0;
+	char labels[64] = "";
+
+	if(label) {
+		snprintf(labels, sizeof(labels), "%s=\"%s\",", label, value);
 	}
 
-	return 1;
+	for(n = 0; n <= nbounds; n++) {
+		cumulative += hist->buckets[n];
+		if(n < nbounds) {
+			fprintf(fp, "%s_bucket{%sle=\"%g\"} %" PRIu64 "\n", name, labels,
+					kMetricBuckets[n], cumulative);
+		} else {
+			fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, cumulative);
+		}
+	}
+
+	/* drop the trailing comma for the plain series */
+	if(label) {
+		labels[strlen(labels) - 1] = '\0';
+		fprintf(fp, "%s_sum{%s} %.6f\n", name, labels, hist->sum);
+		fprintf(fp, "%s_count{%s} %" PRIu64 "\n", name, labels, hist->count);
+	} else {
+		fprintf(fp, "%s_sum %.6f\n", name, hist->sum);
+		fprintf(fp, "%s_count %" PRIu64 "\n", name, hist->count);
+	}
 } /* }}} */
 
-int keycmp(const void *v1, const void *v2)  /* {{{ */
+void metrics_request(CURL *curl, reqtype_t type, CURLcode curlstat) /* {{{ */
 {
-	const struct key_t *k1 = v1;
-	const struct key_t *k2 = v2;
+	struct metrics_t *m = metrics_local();
+	double total = 0;
+	curl_off_t bytes = 0;
+	long httpcode = 0;
 
-	return strcmp(k1->name, k2->name);
+	if(!m) {
+		return;
+	}
+
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
+
+	m->requests[type]++;
+	m->counters[METRIC_BYTES] += bytes;
+	metrics_observe(&m->latency[type], total);
+	if(curlstat != CURLE_OK) {
+		m->counters[METRIC_TRANSFER_ERRORS]++;
+	} else if(httpcode >= 400 && httpcode < 600) {
+		m->httperrors[httpcode - 400]++;
+	}
 } /* }}} */
 
-alpm_list_t *load_targets_from_files(alpm_list_t *files) /* {{{ */
+int metrics_write(void) /* {{{ */
 {
-	alpm_list_t *i, *targets = NULL, *results = NULL;
+	struct metrics_t total, *m;
+	struct timespec now;
+	char *tmp, *contents;
+	size_t len, n;
+	int fd, ret;
+	FILE *fp;
 
-	for(i = files; i; i = i->next) {
-		alpm_list_t *depends = NULL;
-		char *pkgbuild = get_file_as_buffer(i->data);
+	/* every thread that counted anything has been joined by now */
+	memset(&total, 0, sizeof(total));
+	for(m = metrics.threads; m; m = m->next) {
+		for(n = 0; n < METRIC_MAX; n++) {
+			total.counters[n] += m->counters[n];
+		}
+		for(n = 0; n < REQUEST_MAX; n++) {
+			total.requests[n] += m->requests[n];
+			metrics_merge(&total.latency[n], &m->latency[n]);
+		}
+		for(n = 0; n < sizeof(total.httperrors) / sizeof(total.httperrors[0]); n++) {
+			total.httperrors[n] += m->httperrors[n];
+		}
+		metrics_merge(&total.extract, &m->extract);
+		for(n = 0; n < PHASE_MAX; n++) {
+			metrics_merge(&total.phases[n], &m->phases[n]);
+		}
+	}
 
-		alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
-			&depends, &depends, NULL, NULL, NULL
-		};
+	fp = open_memstream(&contents, &len);
+	if(!fp) {
+		return 1;
+	}
 
-		pkgbuild_get_extinfo(pkgbuild, pkg_details);
-		free(pkgbuild);
+	fputs("# HELP cower_requests_total HTTP requests made, by type.\n"
+			"# TYPE cower_requests_total counter\n", fp);
+	for(n = 0; n < REQUEST_MAX; n++) {
+		fprintf(fp, "cower_requests_total{type=\"%s\"} %" PRIu64 "\n",
+				kRequestTypes[n], total.requests[n]);
+	}
+	fprintf(fp, "# HELP cower_downloads_total Tarballs downloaded from the AUR.\n"
+			"# TYPE cower_downloads_total counter\n"
+			"cower_downloads_total %" PRIu64 "\n"
+			"# HELP cower_transferred_bytes_total Bytes received over HTTP.\n"
+			"# TYPE cower_transferred_bytes_total counter\n"
+			"cower_transferred_bytes_total %" PRIu64 "\n"
+			"# HELP cower_cache_hits_total Tarballs extracted from the cache.\n"
+			"# TYPE cower_cache_hits_total counter\n"
+			"cower_cache_hits_total %" PRIu64 "\n"
+			"# HELP cower_cache_misses_total Tarballs not found in the cache.\n"
+			"# TYPE cower_cache_misses_total counter\n"
+			"cower_cache_misses_total %" PRIu64 "\n"
+			"# HELP cower_retries_total Requests retried after a transient failure.\n"
+			"# TYPE cower_retries_total counter\n"
+			"cower_retries_total %" PRIu64 "\n"
+			"# HELP cower_transfer_errors_total Requests which failed without an HTTP response.\n"
+			"# TYPE cower_transfer_errors_total counter\n"
+			"cower_transfer_errors_total %" PRIu64 "\n",
+			total.counters[METRIC_DOWNLOADS], total.counters[METRIC_BYTES],
+			total.counters[METRIC_CACHE_HITS], total.counters[METRIC_CACHE_MISSES],
+			total.counters[METRIC_RETRIES], total.counters[METRIC_TRANSFER_ERRORS]);
+	fputs("# HELP cower_http_errors_total Requests answered with an HTTP error, by code.\n"
+			"# TYPE cower_http_errors_total counter\n", fp);
+	for(n = 0; n < sizeof(total.httperrors) / sizeof(total.httperrors[0]); n++) {
+		if(total.httperrors[n]) {
+			fprintf(fp, "cower_http_errors_total{code=\"%zu\"} %" PRIu64 "\n",
+					n + 400, total.httperrors[n]);
+		}
+	}
 
-		results = alpm_list_join(results, depends);
+	fputs("# HELP cower_request_duration_seconds Time taken by each HTTP request.\n"
+			"# TYPE cower_request_duration_seconds histogram\n", fp);
+	for(n = 0; n < REQUEST_MAX; n++) {
+		metrics_print_histogram(fp, "cower_request_duration_seconds", "type",
+				kRequestTypes[n], &total.latency[n]);
+	}
+	fputs("# HELP cower_extract_duration_seconds Time taken to extract each tarball.\n"
+			"# TYPE cower_extract_duration_seconds histogram\n", fp);
+	metrics_print_histogram(fp, "cower_extract_duration_seconds", NULL, NULL, &total.extract);
+	fputs("# HELP cower_phase_duration_seconds Time spent in each phase of a run.\n"
+			"# TYPE cower_phase_duration_seconds histogram\n", fp);
+	for(n = 0; n < PHASE_MAX; n++) {
+		metrics_print_histogram(fp, "cower_phase_duration_seconds", "phase",
+				kPhases[n], &total.phases[n]);
 	}
 
-	/* sanitize and dedupe */
-	for(i = results; i; i = i->next) {
-		char *sanitized = strdup(i->data);
+	clock_gettime(CLOCK_REALTIME, &now);
+	fprintf(fp, "# HELP cower_last_run_timestamp_seconds When this file was written.\n"
+			"# TYPE cower_last_run_timestamp_seconds gauge\n"
+			"cower_last_run_timestamp_seconds %ld\n", (long)now.tv_sec);
+	fclose(fp);
 
-		sanitized[strcspn(sanitized, "<>=")] = '\0';
-		if(!alpm_list_find_str(targets, sanitized)) {
-			targets = alpm_list_add(targets, sanitized);
+	/* a collector may read the file at any moment, so it's written aside and
+	 * renamed into place, readable by whoever runs the collector */
+	cwr_asprintf(&tmp, "%s.XXXXXX", cfg.metricsfile);
+	fd = mkstemp(tmp);
+	if(fd < 0) {
+		ret = 1;
+	} else {
+		ret = fchmod(fd, 0644) != 0 || fd_write_all(fd, contents, len) != 0;
+		close(fd);
+		if(ret != 0 || rename(tmp, cfg.metricsfile) != 0) {
+			unlink(tmp);
+			ret = 1;
 		}
 	}
+	if(ret != 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to write metrics to %s: %s\n",
+				cfg.metricsfile, strerror(errno));
+	}
+	free(tmp);
+	free(contents);
+
+	return ret;
+} /* }}} */
 
-	return targets;
+long long now_usec(void) /* {{{ */
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 } /* }}} */
 
 void openssl_crypto_cleanup(void) /* {{{ */
@@ -1182,6 +4686,8 @@ void openssl_crypto_cleanup(void) /* {{{ */
 
 	OPENSSL_free(openssl_lock.lock);
 	OPENSSL_free(openssl_lock.lock_count);
+	OPENSSL_free(openssl_lock.stats);
+	openssl_lock.stats = NULL;
 } /* }}} */
 
 void openssl_crypto_init(void) /* {{{ */
@@ -1190,93 +4696,265 @@ void openssl_crypto_init(void) /* {{{ */
 
 	openssl_lock.lock = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(pthread_mutex_t));
 	openssl_lock.lock_count = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(long));
+	openssl_lock.stats = OPENSSL_malloc(CRYPTO_num_locks() * sizeof(struct lockstat_t));
 	for(i = 0; i < CRYPTO_num_locks(); i++) {
 		openssl_lock.lock_count[i] = 0;
 		pthread_mutex_init(&(openssl_lock.lock[i]), NULL);
 	}
+	lockstat_reset();
 
 	CRYPTO_set_id_callback(openssl_thread_id);
 	CRYPTO_set_locking_callback(openssl_thread_cb);
 } /* }}} */
 
-void openssl_thread_cb(int mode, int type, const char UNUSED *file, /* {{{ */
-		int UNUSED line)
+void openssl_thread_cb(int mode, int type, const char UNUSED *file, /* {{{ */
+		int UNUSED line)
+{
+	if(mode & CRYPTO_LOCK) {
+		timeline_lock(&(openssl_lock.lock[type]), &(openssl_lock.stats[type]));
+		openssl_lock.lock_count[type]++;
+	} else {
+		timeline_unlock(&(openssl_lock.lock[type]), &(openssl_lock.stats[type]));
+		openssl_lock.lock_count[type]--;
+	}
+} /* }}} */
+
+unsigned long openssl_thread_id(void) /* {{{ */
+{
+	return pthread_self();
+} /* }}} */
+
+void output_field(FILE *fp, int *fields, char type, const char *name, size_t len) /* {{{ */
+{
+	if(cfg.output == OUTPUT_JSONL) {
+		if((*fields)++) {
+			fputc(',', fp);
+		}
+		json_fputs(name, fp);
+		fputc(':', fp);
+		return;
+	}
+
+	/* a type, the name, and the length of what follows */
+	fputc(type, fp);
+	fputc((int)strlen(name), fp);
+	fputs(name, fp);
+	output_u32(fp, (uint32_t)len);
+} /* }}} */
+
+void output_integer(FILE *fp, int *fields, const char *name, long long value) /* {{{ */
+{
+	int shift;
+
+	output_field(fp, fields, 'i', name, 8);
+	if(cfg.output == OUTPUT_JSONL) {
+		fprintf(fp, "%lld", value);
+		return;
+	}
+
+	for(shift = 56; shift >= 0; shift -= 8) {
+		fputc((int)(((unsigned long long)value >> shift) & 0xff), fp);
+	}
+} /* }}} */
+
+void output_list(FILE *fp, int *fields, const char *name, /* {{{ */
+		const struct aurpkg_t *pkg, pkgdetail_t type)
+{
+	size_t n, count, len = 0;
+	const char **list = aurpkg_detail(pkg, type, &count);
+
+	for(n = 0; n < count; n++) {
+		len += 4 + strlen(list[n]);
+	}
+
+	output_field(fp, fields, 'l', name, len);
+	if(cfg.output == OUTPUT_JSONL) {
+		fputc('[', fp);
+		for(n = 0; n < count; n++) {
+			if(n) {
+				fputc(',', fp);
+			}
+			json_fputs(list[n], fp);
+		}
+		fputc(']', fp);
+		return;
+	}
+
+	for(n = 0; n < count; n++) {
+		size_t itemlen = strlen(list[n]);
+		output_u32(fp, (uint32_t)itemlen);
+		fwrite(list[n], 1, itemlen, fp);
+	}
+} /* }}} */
+
+void output_record(const struct aurpkg_t *pkg) /* {{{ */
+{
+	FILE *fp;
+	char *body = NULL;
+	size_t len = 0;
+	int fields = 0;
+
+	/* each record is put together on the side, and written out in one go so
+	 * that records from different threads never interleave */
+	fp = open_memstream(&body, &len);
+	if(!fp) {
+		return;
+	}
+
+	if(cfg.output == OUTPUT_JSONL) {
+		fputc('{', fp);
+	}
+	output_string(fp, &fields, "Name", pkg->name);
+	output_string(fp, &fields, "Version", pkg->ver);
+	output_string(fp, &fields, "Description", pkg->desc);
+	output_string(fp, &fields, "URL", pkg->url);
+	output_string(fp, &fields, "URLPath", pkg->urlpath);
+	output_string(fp, &fields, "License", pkg->lic);
+	output_string(fp, &fields, "Maintainer", pkg->maint);
+	output_integer(fp, &fields, "ID", pkg->id);
+	output_integer(fp, &fields, "CategoryID", pkg->cat);
+	output_integer(fp, &fields, "NumVotes", pkg->votes);
+	output_integer(fp, &fields, "OutOfDate", pkg->ood);
+	output_integer(fp, &fields, "FirstSubmitted", (long long)pkg->firstsub);
+	output_integer(fp, &fields, "LastModified", (long long)pkg->lastmod);
+	output_list(fp, &fields, "Depends", pkg, PKGDETAIL_DEPENDS);
+	output_list(fp, &fields, "MakeDepends", pkg, PKGDETAIL_MAKEDEPENDS);
+	output_list(fp, &fields, "OptDepends", pkg, PKGDETAIL_OPTDEPENDS);
+	output_list(fp, &fields, "Provides", pkg, PKGDETAIL_PROVIDES);
+	output_list(fp, &fields, "Conflicts", pkg, PKGDETAIL_CONFLICTS);
+	output_list(fp, &fields, "Replaces", pkg, PKGDETAIL_REPLACES);
+	if(cfg.opmask & OP_UPDATE) {
+		alpm_pkg_t *pmpkg = alpm_db_get_pkg(alpm_localdb(), pkg->name);
+		output_string(fp, &fields, "InstalledVersion",
+				pmpkg ? alpm_pkg_get_version(pmpkg) : NULL);
+	}
+	if(cfg.output == OUTPUT_JSONL) {
+		fputs("}\n", fp);
+	}
+
+	if(fclose(fp) != 0) {
+		free(body);
+		return;
+	}
+
+	flockfile(stdout);
+	if(cfg.output == OUTPUT_BINARY) {
+		output_u32(stdout, (uint32_t)len);
+	}
+	fwrite(body, 1, len, stdout);
+	fflush(stdout);
+	funlockfile(stdout);
+
+	free(body);
+} /* }}} */
+
+void output_results(alpm_list_t *results) /* {{{ */
+{
+	alpm_list_t *i;
+
+	for(i = results; i; i = alpm_list_next(i)) {
+		struct aurpkg_t *pkg = i->data;
+		int fresh;
+
+		/* a package can turn up under more than one search term */
+		flockfile(stdout);
+		fresh = strset_add(&emitted, NULL, pkg->name, strlen(pkg->name));
+		funlockfile(stdout);
+
+		if(fresh) {
+			output_record(pkg);
+		}
+	}
+} /* }}} */
+
+void output_string(FILE *fp, int *fields, const char *name, const char *value) /* {{{ */
 {
-	if(mode & CRYPTO_LOCK) {
-		pthread_mutex_lock(&(openssl_lock.lock[type]));
-		openssl_lock.lock_count[type]++;
-	} else {
-		pthread_mutex_unlock(&(openssl_lock.lock[type]));
-		openssl_lock.lock_count[type]--;
+	size_t len;
+
+	/* missing strings are null here, and left out of binary records */
+	if(cfg.output == OUTPUT_JSONL) {
+		output_field(fp, fields, 's', name, 0);
+		json_fputs(value, fp);
+		return;
+	}
+
+	if(!value) {
+		return;
 	}
+
+	len = strlen(value);
+	output_field(fp, fields, 's', name, len);
+	fwrite(value, 1, len, fp);
 } /* }}} */
 
-unsigned long openssl_thread_id(void) /* {{{ */
+void output_u32(FILE *fp, uint32_t value) /* {{{ */
 {
-	return pthread_self();
+	fputc((int)((value >> 24) & 0xff), fp);
+	fputc((int)((value >> 16) & 0xff), fp);
+	fputc((int)((value >> 8) & 0xff), fp);
+	fputc((int)(value & 0xff), fp);
 } /* }}} */
 
-alpm_list_t *parse_bash_array(alpm_list_t *deplist, char *array, pkgdetail_t type) /* {{{ */
+const char *parse_bash_array(const char *ptr, const char *end, alpm_list_t **deplist, /* {{{ */
+		pkgdetail_t type, struct strset_t *seen)
 {
-	char *ptr, *token, *saveptr;
+	while(ptr < end) {
+		const char *token, *tokend;
 
-	if(!array) {
-		return NULL;
-	}
-
-	if(type == PKGDETAIL_OPTDEPENDS) {
-		const char *arrayend = rawmemchr(array, '\0');
-		for(token = array; token <= arrayend; token++) {
-			if(*token == '\'' || *token == '\"') {
-				token++;
-				ptr = memchr(token, *(token - 1), arrayend - token);
-				*ptr = '\0';
-			} else if(isalpha(*token)) {
-				ptr = token;
-				while(!isspace(*++ptr));
-				*(ptr - 1) = '\0';
-			} else {
-				continue;
-			}
-
-			strtrim(token);
-			cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
-			deplist = alpm_list_add(deplist, strdup(token));
+		if(isspace((unsigned char)*ptr)) {
+			ptr++;
+			continue;
+		}
 
-			token = ptr;
+		if(*ptr == ')') {
+			return ptr + 1;
 		}
-		return deplist;
-	}
 
-	for(token = strtok_r(array, " \t\n", &saveptr); token;
-			token = strtok_r(NULL, " \t\n", &saveptr)) {
 		/* found an embedded comment. skip to the next line */
-		if(*token == '#') {
-			strtok_r(NULL, "\n", &saveptr);
+		if(*ptr == '#') {
+			ptr = memchr(ptr, '\n', end - ptr);
+			if(!ptr) {
+				return end;
+			}
 			continue;
 		}
 
-		/* unquote the element */
-		if(*token == '\'' || *token == '\"') {
-			ptr = strrchr(token + 1, *token);
-			if(ptr) {
-				token++;
-				*ptr = '\0';
+		/* quoted elements are taken whole, anything else ends at whitespace */
+		if(*ptr == '\'' || *ptr == '\"') {
+			tokend = memchr(ptr + 1, *ptr, end - ptr - 1);
+			if(!tokend) {
+				return end;
+			}
+			token = ptr + 1;
+			ptr = tokend + 1;
+		} else {
+			token = ptr;
+			while(ptr < end && !isspace((unsigned char)*ptr) && *ptr != ')') {
+				ptr++;
 			}
+			tokend = ptr;
 		}
 
-		/* some people feel compelled to do insane things in PKGBUILDs. these people suck */
-		if(!*token || strlen(token) < 2 || *token == '$') {
+		if(type == PKGDETAIL_OPTDEPENDS) {
+			while(token < tokend && isspace((unsigned char)*token)) {
+				token++;
+			}
+			while(tokend > token && isspace((unsigned char)*(tokend - 1))) {
+				tokend--;
+			}
+		} else if(tokend - token < 2) {
+			/* some people feel compelled to do insane things in PKGBUILDs. these people suck */
 			continue;
 		}
 
-		cwr_printf(LOG_DEBUG, "adding depend: %s\n", token);
-		if(!alpm_list_find_str(deplist, token)) {
-			deplist = alpm_list_add(deplist, strdup(token));
+		if(token == tokend || *token == '$') {
+			continue;
 		}
+
+		extinfo_add(deplist, token, tokend - token, seen);
 	}
 
-	return deplist;
+	return end;
 } /* }}} */
 
 int parse_configfile(void) /* {{{ */
@@ -1353,6 +5031,24 @@ int parse_configfile(void) /* {{{ */
 					ret = 1;
 				}
 			}
+		} else if(streq(key, "CacheDir")) {
+			if(val && !cfg.cachedir) {
+				wordexp_t p;
+				if(wordexp(val, &p, 0) == 0) {
+					if(p.we_wordc == 1) {
+						cfg.cachedir = strdup(p.we_wordv[0]);
+					}
+					wordfree(&p);
+					/* error on relative paths */
+					if(cfg.cachedir && *cfg.cachedir != '/') {
+						fprintf(stderr, "error: CacheDir cannot be a relative path\n");
+						ret = 1;
+					}
+				} else {
+					fprintf(stderr, "error: failed to resolve option to CacheDir\n");
+					ret = 1;
+				}
+			}
 		} else if(streq(key, "MaxThreads")) {
 			if(val && cfg.maxthreads == kUnset) {
 				cfg.maxthreads = strtol(val, &key, 10);
@@ -1361,6 +5057,95 @@ int parse_configfile(void) /* {{{ */
 					ret = 1;
 				}
 			}
+		} else if(streq(key, "RequestTimeout")) {
+			if(val && cfg.reqtimeout == kUnset) {
+				cfg.reqtimeout = strtol(val, &key, 10);
+				if(*key != '\0' || cfg.reqtimeout < 0) {
+					fprintf(stderr, "error: invalid option to RequestTimeout: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "Deadline")) {
+			if(val && cfg.deadline == kUnset) {
+				cfg.deadline = strtol(val, &key, 10);
+				if(*key != '\0' || cfg.deadline < 0) {
+					fprintf(stderr, "error: invalid option to Deadline: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "LowSpeedLimit")) {
+			if(val && cfg.lowspeedlimit == kUnset) {
+				cfg.lowspeedlimit = strtol(val, &key, 10);
+				if(*key != '\0' || cfg.lowspeedlimit < 0) {
+					fprintf(stderr, "error: invalid option to LowSpeedLimit: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "LowSpeedTime")) {
+			if(val && cfg.lowspeedtime == kUnset) {
+				cfg.lowspeedtime = strtol(val, &key, 10);
+				if(*key != '\0' || cfg.lowspeedtime < 0) {
+					fprintf(stderr, "error: invalid option to LowSpeedTime: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "Retries")) {
+			if(val && cfg.retries == kUnset) {
+				cfg.retries = strtol(val, &key, 10);
+				if(*key != '\0' || cfg.retries < 0) {
+					fprintf(stderr, "error: invalid option to Retries: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "RPCRate")) {
+			if(val && rpcbucket.rate == kUnset) {
+				rpcbucket.rate = strtod(val, &key);
+				if(*key != '\0' || rpcbucket.rate < 0) {
+					fprintf(stderr, "error: invalid option to RPCRate: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "RPCBurst")) {
+			if(val && rpcbucket.burst == kUnset) {
+				rpcbucket.burst = strtod(val, &key);
+				if(*key != '\0' || rpcbucket.burst < 1) {
+					fprintf(stderr, "error: invalid option to RPCBurst: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "DownloadRate")) {
+			if(val && dlbucket.rate == kUnset) {
+				dlbucket.rate = strtod(val, &key);
+				if(*key != '\0' || dlbucket.rate < 0) {
+					fprintf(stderr, "error: invalid option to DownloadRate: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "DownloadBurst")) {
+			if(val && dlbucket.burst == kUnset) {
+				dlbucket.burst = strtod(val, &key);
+				if(*key != '\0' || dlbucket.burst < 1) {
+					fprintf(stderr, "error: invalid option to DownloadBurst: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "Incremental")) {
+			if(cfg.incremental == kUnset) {
+				if(!val) {
+					cfg.incremental = 1;
+				} else if(streq(val, "content")) {
+					cfg.incremental = 2;
+				} else {
+					fprintf(stderr, "error: invalid option to Incremental: %s\n", val);
+					ret = 1;
+				}
+			}
+		} else if(streq(key, "Prune")) {
+			cfg.prune |= 1;
+		} else if(streq(key, "Hedge")) {
+			if(cfg.hedge == kUnset) {
+				cfg.hedge = 1;
+			}
 		} else if(streq(key, "ConnectTimeout")) {
 			if(val && cfg.timeout == kUnset) {
 				cfg.timeout = strtol(val, &key, 10);
@@ -1372,7 +5157,7 @@ int parse_configfile(void) /* {{{ */
 		} else if(streq(key, "Color")) {
 			if(cfg.color == kUnset) {
 				if(!val || streq(val, "auto")) {
-					if(isatty(fileno(stdout))) {
+					if(term_isatty()) {
 						cfg.color = 1;
 					} else {
 						cfg.color = 0;
@@ -1413,21 +5198,42 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 
 		/* options */
 		{"brief",         no_argument,        0, 'b'},
+		{"cache-dir",     required_argument,  0, OP_CACHEDIR},
 		{"color",         optional_argument,  0, 'c'},
+		{"daemon",        no_argument,        0, OP_DAEMON},
+		{"deadline",      required_argument,  0, OP_DEADLINE},
 		{"debug",         no_argument,        0, OP_DEBUG},
+		{"download-burst", required_argument, 0, OP_DLBURST},
+		{"download-rate", required_argument,  0, OP_DLRATE},
 		{"force",         no_argument,        0, 'f'},
 		{"format",        required_argument,  0, OP_FORMAT},
 		{"from-pkgbuild", no_argument,        0, 'p'},
+		{"hedge",         no_argument,        0, OP_HEDGE},
 		{"help",          no_argument,        0, 'h'},
 		{"ignore",        required_argument,  0, OP_IGNOREPKG},
 		{"ignore-ood",    no_argument,        0, 'o'},
+		{"no-daemon",     no_argument,        0, OP_NODAEMON},
 		{"no-ignore-ood", no_argument,        0, OP_NOIGNOREOOD},
+		{"output",        required_argument,  0, OP_OUTPUT},
 		{"ignorerepo",    optional_argument,  0, OP_IGNOREREPO},
+		{"incremental",   optional_argument,  0, OP_INCREMENTAL},
+		{"limit",         required_argument,  0, OP_LIMIT},
 		{"listdelim",     required_argument,  0, OP_LISTDELIM},
+		{"low-speed-limit", required_argument, 0, OP_LOWSPEEDLIMIT},
+		{"low-speed-time", required_argument, 0, OP_LOWSPEEDTIME},
+		{"metrics-file",  required_argument,  0, OP_METRICS},
+		{"prune",         no_argument,        0, OP_PRUNE},
 		{"quiet",         no_argument,        0, 'q'},
+		{"request-timeout", required_argument, 0, OP_REQTIMEOUT},
+		{"retries",       required_argument,  0, OP_RETRIES},
+		{"rpc-burst",     required_argument,  0, OP_RPCBURST},
+		{"rpc-rate",      required_argument,  0, OP_RPCRATE},
+		{"sort",          required_argument,  0, OP_SORT},
 		{"target",        required_argument,  0, 't'},
 		{"threads",       required_argument,  0, OP_THREADS},
+		{"timeline",      required_argument,  0, OP_TIMELINE},
 		{"timeout",       required_argument,  0, OP_TIMEOUT},
+		{"trace-requests", required_argument, 0, OP_TRACE},
 		{"verbose",       no_argument,        0, 'v'},
 		{"version",       no_argument,        0, 'V'},
 		{0, 0, 0, 0}
@@ -1468,7 +5274,7 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 				break;
 			case 'c':
 				if(!optarg || streq(optarg, "auto")) {
-					if(isatty(fileno(stdout))) {
+					if(term_isatty()) {
 						cfg.color = 1;
 					} else {
 						cfg.color = 0;
@@ -1500,6 +5306,17 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 			case 'V':
 				version();
 				return 2;
+			case OP_CACHEDIR:
+				free(cfg.cachedir);
+				cfg.cachedir = strdup(optarg);
+				break;
+			case OP_DAEMON:
+			case OP_NODAEMON:
+				/* handled before we ever get here */
+				break;
+			case OP_METRICS:
+				cfg.metricsfile = optarg;
+				break;
 			case OP_DEBUG:
 				cfg.logmask |= LOG_DEBUG;
 				break;
@@ -1534,6 +5351,116 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 			case OP_LISTDELIM:
 				cfg.delim = optarg;
 				break;
+			case OP_DEADLINE:
+				cfg.deadline = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.deadline < 0) {
+					fprintf(stderr, "error: invalid argument to --deadline\n");
+					return 1;
+				}
+				break;
+			case OP_HEDGE:
+				cfg.hedge = 1;
+				break;
+			case OP_INCREMENTAL:
+				if(!optarg) {
+					cfg.incremental = 1;
+				} else if(streq(optarg, "content")) {
+					cfg.incremental = 2;
+				} else {
+					fprintf(stderr, "error: invalid argument to --incremental\n");
+					return 1;
+				}
+				break;
+			case OP_OUTPUT:
+				if(streq(optarg, "jsonl")) {
+					cfg.output = OUTPUT_JSONL;
+				} else if(streq(optarg, "binary")) {
+					cfg.output = OUTPUT_BINARY;
+				} else {
+					fprintf(stderr, "error: invalid argument to --output\n");
+					return 1;
+				}
+				break;
+			case OP_PRUNE:
+				cfg.prune |= 1;
+				break;
+			case OP_LOWSPEEDLIMIT:
+				cfg.lowspeedlimit = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.lowspeedlimit < 0) {
+					fprintf(stderr, "error: invalid argument to --low-speed-limit\n");
+					return 1;
+				}
+				break;
+			case OP_LOWSPEEDTIME:
+				cfg.lowspeedtime = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.lowspeedtime < 0) {
+					fprintf(stderr, "error: invalid argument to --low-speed-time\n");
+					return 1;
+				}
+				break;
+			case OP_REQTIMEOUT:
+				cfg.reqtimeout = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.reqtimeout < 0) {
+					fprintf(stderr, "error: invalid argument to --request-timeout\n");
+					return 1;
+				}
+				break;
+			case OP_DLBURST:
+				dlbucket.burst = strtod(optarg, &token);
+				if(*token != '\0' || dlbucket.burst < 1) {
+					fprintf(stderr, "error: invalid argument to --download-burst\n");
+					return 1;
+				}
+				break;
+			case OP_DLRATE:
+				dlbucket.rate = strtod(optarg, &token);
+				if(*token != '\0' || dlbucket.rate < 0) {
+					fprintf(stderr, "error: invalid argument to --download-rate\n");
+					return 1;
+				}
+				break;
+			case OP_RPCBURST:
+				rpcbucket.burst = strtod(optarg, &token);
+				if(*token != '\0' || rpcbucket.burst < 1) {
+					fprintf(stderr, "error: invalid argument to --rpc-burst\n");
+					return 1;
+				}
+				break;
+			case OP_RPCRATE:
+				rpcbucket.rate = strtod(optarg, &token);
+				if(*token != '\0' || rpcbucket.rate < 0) {
+					fprintf(stderr, "error: invalid argument to --rpc-rate\n");
+					return 1;
+				}
+				break;
+			case OP_RETRIES:
+				cfg.retries = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.retries < 0) {
+					fprintf(stderr, "error: invalid argument to --retries\n");
+					return 1;
+				}
+				break;
+			case OP_LIMIT:
+				cfg.limit = strtol(optarg, &token, 10);
+				if(*token != '\0' || cfg.limit <= 0) {
+					fprintf(stderr, "error: invalid argument to --limit\n");
+					return 1;
+				}
+				break;
+			case OP_SORT:
+				if(streq(optarg, "name")) {
+					cfg.sortkey = SORT_NAME;
+				} else if(streq(optarg, "votes")) {
+					cfg.sortkey = SORT_VOTES;
+				} else if(streq(optarg, "lastmod")) {
+					cfg.sortkey = SORT_LASTMOD;
+				} else if(streq(optarg, "firstsub")) {
+					cfg.sortkey = SORT_FIRSTSUB;
+				} else {
+					fprintf(stderr, "error: invalid argument to --sort\n");
+					return 1;
+				}
+				break;
 			case OP_THREADS:
 				cfg.maxthreads = strtol(optarg, &token, 10);
 				if(*token != '\0' || cfg.maxthreads <= 0) {
@@ -1541,6 +5468,9 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 					return 1;
 				}
 				break;
+			case OP_TIMELINE:
+				cfg.timeline = optarg;
+				break;
 			case OP_TIMEOUT:
 				cfg.timeout = strtol(optarg, &token, 10);
 				if(*token != '\0') {
@@ -1548,99 +5478,459 @@ int parse_options(int argc, char *argv[]) /* {{{ */
 					return 1;
 				}
 				break;
+			case OP_TRACE:
+				cfg.tracefile = optarg;
+				break;
 			case '?':
 			default:
 				return 1;
 		}
-	}
+	}
+
+	if(!cfg.opmask) {
+		return 3;
+	}
+
+#define NOT_EXCL(val) (cfg.opmask & (val) && (cfg.opmask & ~(val)))
+	/* check for invalid operation combos */
+	if(NOT_EXCL(OP_INFO) || NOT_EXCL(OP_SEARCH) || NOT_EXCL(OP_MSEARCH) ||
+			NOT_EXCL(OP_UPDATE|OP_DOWNLOAD)) {
+		fprintf(stderr, "error: invalid operation\n");
+		return 2;
+	}
+
+	while(optind < argc) {
+		if(streq(argv[optind], "-") && !cfg.frompkgbuild) {
+			cfg.fromstdin |= 1;
+		} else {
+			target_add(argv[optind], strlen(argv[optind]));
+		}
+		optind++;
+	}
+
+	return 0;
+} /* }}} */
+
+void pipeline_done(struct dljob_t *job) /* {{{ */
+{
+	if(job->measured && cfg.cachedir) {
+		history_record(job);
+	}
+
+	response_put(job->response);
+	free(job->name);
+	free(job->urlpath);
+	free(job->subdir);
+	free(job);
+
+	pipeline_release();
+} /* }}} */
+
+void pipeline_enqueue(const char *target) /* {{{ */
+{
+	timeline_lock(&listlock, &liststat);
+	pipeline.depq = alpm_list_add(pipeline.depq, (void*)target);
+	pipeline.busy++;
+	pthread_cond_signal(&pipeline.idle);
+	timeline_unlock(&listlock, &liststat);
+} /* }}} */
+
+void pipeline_push(stage_t id, struct dljob_t *job) /* {{{ */
+{
+	struct stage_t *stage = &pipeline.stages[id];
+	const char *target = job->target;
+	long long start = now_usec();
+
+	/* a full stage holds its producer back, which is what keeps the number
+	 * of tarballs in memory bounded. the last stage never waits on anything
+	 * but the lookup queue, which has no bound, so this can't deadlock */
+	timeline_lock(&listlock, &liststat);
+	while(stage->count >= stage->capacity) {
+		timeline_wait(&stage->space, &listlock, &liststat);
+	}
+	job->next = NULL;
+	if(stage->tail) {
+		stage->tail->next = job;
+	} else {
+		stage->head = job;
+	}
+	stage->tail = job;
+	stage->count++;
+	pthread_cond_signal(&stage->ready);
+	timeline_unlock(&listlock, &liststat);
+	timeline_event("stage wait", "queue", start, target);
+} /* }}} */
+
+void pipeline_release(void) /* {{{ */
+{
+	timeline_lock(&listlock, &liststat);
+	if(--pipeline.busy == 0) {
+		pthread_cond_broadcast(&pipeline.idle);
+	}
+	timeline_unlock(&listlock, &liststat);
+} /* }}} */
+
+int pipeline_start(int fetchers) /* {{{ */
+{
+	int n, s, ret, disk;
+	struct stage_t *stage;
+
+	disk = sysconf(_SC_NPROCESSORS_ONLN);
+	disk = disk < 1 ? 1 : disk > kDiskWorkersMax ? kDiskWorkersMax : disk;
+
+	pipeline.stages[STAGE_FETCH].name = "fetch";
+	pipeline.stages[STAGE_FETCH].fn = download_fetch;
+	pipeline.stages[STAGE_FETCH].network = 1;
+	pipeline.stages[STAGE_FETCH].workers = fetchers;
+	pipeline.stages[STAGE_EXTRACT].name = "extract";
+	pipeline.stages[STAGE_EXTRACT].fn = download_extract;
+	pipeline.stages[STAGE_EXTRACT].workers = disk;
+	pipeline.stages[STAGE_SCAN].name = "scan";
+	pipeline.stages[STAGE_SCAN].fn = download_resolve;
+	pipeline.stages[STAGE_SCAN].workers = cfg.getdeps ? 1 : 0;
+
+	pipeline.deps = pipeline.depq = pipeline.known = pipeline.missing = NULL;
+	pipeline.busy = pipeline.closing = pipeline.closure = 0;
+	pipeline.nthreads = 0;
+	pipeline.threads = malloc((fetchers + disk + 1) * sizeof(pthread_t));
+	if(!pipeline.threads) {
+		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for threads\n");
+		return 1;
+	}
+
+	for(s = 0; s < STAGE_MAX; s++) {
+		stage = &pipeline.stages[s];
+		stage->head = stage->tail = NULL;
+		stage->count = 0;
+		stage->capacity = stage->workers * kStageDepth;
+
+		for(n = 0; n < stage->workers; n++) {
+			ret = pthread_create(&pipeline.threads[pipeline.nthreads], NULL, stage_worker, stage);
+			if(ret != 0) {
+				cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
+						strerror(ret));
+				pipeline_stop();
+				return 1;
+			}
+			pipeline.nthreads++;
+		}
+	}
+
+	pipeline.active = 1;
+
+	return 0;
+} /* }}} */
+
+void pipeline_stop(void) /* {{{ */
+{
+	int s, n;
+
+	/* nothing is left in flight by the time the lookups are done, so this
+	 * only has to wake the stages up and let them go */
+	timeline_lock(&listlock, &liststat);
+	pipeline.closing = 1;
+	for(s = 0; s < STAGE_MAX; s++) {
+		pthread_cond_broadcast(&pipeline.stages[s].ready);
+	}
+	timeline_unlock(&listlock, &liststat);
+
+	for(n = 0; n < pipeline.nthreads; n++) {
+		pthread_join(pipeline.threads[n], NULL);
+	}
+
+	free(pipeline.threads);
+	pipeline.threads = NULL;
+	FREELIST(pipeline.deps);
+	alpm_list_free_inner(pipeline.known, aurpkg_free);
+	alpm_list_free(pipeline.known);
+	alpm_list_free(pipeline.missing);
+	pipeline.known = pipeline.missing = NULL;
+	pipeline.nthreads = 0;
+	pipeline.active = 0;
+} /* }}} */
+
+int pkg_is_binary(const char *pkg) /* {{{ */
+{
+	const char *db = alpm_provides_pkg(pkg);
+
+	if(db) {
+		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_WARN "\t%s\t", pkg);
+		cwr_fprintf(stderr, LOG_WARN, "%s%s%s is available in %s%s%s\n",
+				colstr.pkg, pkg, colstr.nc,
+				colstr.repo, db, colstr.nc);
+		return 1;
+	}
+
+	return 0;
+} /* }}} */
+
+void pkgbuild_fetch_extinfo(CURL *curl, alpm_list_t *pkglist) /* {{{ */
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	CURL **idle;
+	struct extinfo_t *fetches;
+	const alpm_list_t *i;
+	int count, n, msgs, running, inflight = 0, done = 0, nidle = 0;
+
+	count = alpm_list_count(pkglist);
+	fetches = calloc(count, sizeof(struct extinfo_t));
+	idle = calloc(count + 1, sizeof(CURL*));
+	multi = curl_multi_init();
+	if(!fetches || !idle || !multi) {
+		cwr_fprintf(stderr, LOG_ERROR, "failed to allocate memory\n");
+		goto finish;
+	}
+
+	for(i = pkglist, n = 0; i; i = alpm_list_next(i), n++) {
+		struct aurpkg_t *pkg = i->data;
+		char *escaped = url_escape(pkg->urlpath, 0, "/");
+
+		fetches[n].pkg = pkg;
+		cwr_asprintf(&fetches[n].url, AUR_BASE_URL "%s", escaped);
+		memcpy(strrchr(fetches[n].url, '/') + 1, "PKGBUILD\0", 9);
+		free(escaped);
+	}
+
+	/* handles are passed on from one finished request to the next, so there
+	 * are never more of them than there have been requests in flight */
+	idle[nidle++] = curl;
+
+	/* every PKGBUILD goes out at once, as far as the limiter allows, and each
+	 * is parsed as soon as it has arrived while the rest are still in flight */
+	while(done < count) {
+		long long now = now_usec(), due = 0;
+		long wait = 1000;
+
+		for(n = 0; n < count; n++) {
+			struct extinfo_t *fetch = &fetches[n];
+			long timeout = cfg.reqtimeout * 1000;
+
+			if(fetch->state != EXTINFO_WAITING) {
+				continue;
+			}
+			if(fetch->due > now) {
+				due = due && due < fetch->due ? due : fetch->due;
+				continue;
+			}
+
+			/* block for the first request, but never for any of the others */
+			if(inflight == 0) {
+				if(bucket_acquire(&dlbucket) != 0) {
+					cwr_printf(LOG_DEBUG, "[%s]: run deadline exceeded\n", fetch->pkg->name);
+					fetch->state = EXTINFO_DONE;
+					done++;
+					continue;
+				}
+				limiter_acquire();
+			} else if(!limiter_tryacquire()) {
+				wait = 10;
+				break;
+			} else if(!bucket_tryacquire(&dlbucket)) {
+				limiter_release(NULL, CURLE_OK);
+				wait = 10;
+				break;
+			}
+
+			if(run_deadline) {
+				long long remaining = (run_deadline - now_usec()) / 1000;
+				if(remaining <= 0) {
+					cwr_printf(LOG_DEBUG, "[%s]: run deadline exceeded\n", fetch->pkg->name);
+					limiter_release(NULL, CURLE_OK);
+					fetch->state = EXTINFO_DONE;
+					done++;
+					continue;
+				}
+				if(timeout == 0 || remaining < timeout) {
+					timeout = (long)remaining;
+				}
+			}
+
+			fetch->handle = nidle ? idle[--nidle] : curl_handle_get();
+			if(!fetch->response) {
+				fetch->response = response_get();
+			}
+			if(!fetch->handle || !fetch->response) {
+				cwr_fprintf(stderr, LOG_ERROR, "[%s]: failed to allocate request\n",
+						fetch->pkg->name);
+				if(fetch->handle) {
+					idle[nidle++] = fetch->handle;
+				}
+				limiter_release(NULL, CURLE_OK);
+				fetch->state = EXTINFO_DONE;
+				done++;
+				continue;
+			}
+
+			curl_init_easy_handle(fetch->handle);
+			curl_easy_setopt(fetch->handle, CURLOPT_URL, fetch->url);
+			curl_easy_setopt(fetch->handle, CURLOPT_WRITEFUNCTION, curl_write_response);
+			curl_easy_setopt(fetch->handle, CURLOPT_WRITEDATA, fetch->response);
+			curl_easy_setopt(fetch->handle, CURLOPT_PRIVATE, fetch);
+			curl_easy_setopt(fetch->handle, CURLOPT_TIMEOUT_MS, timeout);
+			fetch->response->handle = fetch->handle;
+
+			cwr_printf(LOG_DEBUG, "[%s]: curl_multi_perform %s\n", fetch->pkg->name, fetch->url);
+			if(!fetch->start) {
+				fetch->start = now_usec();
+			}
+			curl_multi_add_handle(multi, fetch->handle);
+			fetch->state = EXTINFO_RUNNING;
+			inflight++;
+		}
+
+		curl_multi_perform(multi, &running);
+		while((msg = curl_multi_info_read(multi, &msgs))) {
+			struct extinfo_t *fetch;
+			CURLcode curlstat = msg->data.result;
+			long httpcode = 0, delay;
+
+			if(msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&fetch);
+			curl_multi_remove_handle(multi, fetch->handle);
+			limiter_release(fetch->handle, curlstat);
+			if(tracefp) {
+				trace_request(fetch->handle, REQUEST_PKGBUILD, fetch->pkg->name, curlstat);
+			}
+			metrics_request(fetch->handle, REQUEST_PKGBUILD, curlstat);
+			if(curlstat == CURLE_OK) {
+				curl_easy_getinfo(fetch->handle, CURLINFO_RESPONSE_CODE, &httpcode);
+			}
+			inflight--;
+			idle[nidle++] = fetch->handle;
+
+			if(fetch->attempt < cfg.retries && request_is_transient(curlstat, httpcode)) {
+				/* same backoff as curl_perform, without holding up the others */
+				delay = kRetryDelay << fetch->attempt;
+				if(delay > kRetryDelayMax) {
+					delay = kRetryDelayMax;
+				}
+				delay = delay / 2 + rand_r(&jitter_seed) % (delay / 2 + 1);
+				fetch->attempt++;
+				fetch->due = now_usec() + delay * 1000;
+				fetch->state = EXTINFO_WAITING;
+				response_reset(fetch->response);
+				cwr_printf(LOG_DEBUG, "[%s]: retrying in %ldms (attempt %d of %d)\n",
+						fetch->pkg->name, delay, fetch->attempt, cfg.retries);
+				metrics_count(METRIC_RETRIES, 1);
+				continue;
+			}
+
+			if(curlstat != CURLE_OK) {
+				cwr_fprintf(stderr, LOG_ERROR, "%s: %s\n", fetch->url, curl_easy_strerror(curlstat));
+			} else if(httpcode >= 400) {
+				cwr_fprintf(stderr, LOG_ERROR, "%s: server responded with HTTP %ld\n",
+						fetch->url, httpcode);
+			} else {
+				struct aurpkg_t *pkg = fetch->pkg;
+				alpm_list_t *details[PKGDETAIL_MAX] = { NULL };
+				alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+					&details[0], &details[1], &details[2], &details[3], &details[4], &details[5]
+				};
+				pkgdetail_t type;
+
+				cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", pkg->name, httpcode);
+				pkgbuild_get_extinfo(fetch->response->data, fetch->response->size, pkg_details);
+				for(type = 0; type < PKGDETAIL_MAX; type++) {
+					alpm_list_t *j;
+					for(j = details[type]; j; j = alpm_list_next(j)) {
+						aurpkg_add_detail(pkg, type, j->data, strlen(j->data));
+					}
+					FREELIST(details[type]);
+				}
+			}
+			timeline_event(kRequestSpans[REQUEST_PKGBUILD], "net", fetch->start, fetch->pkg->name);
+
+			fetch->state = EXTINFO_DONE;
+			done++;
+		}
 
-	if(!cfg.opmask) {
-		return 3;
-	}
+		if(done == count) {
+			break;
+		}
 
-#define NOT_EXCL(val) (cfg.opmask & (val) && (cfg.opmask & ~(val)))
-	/* check for invalid operation combos */
-	if(NOT_EXCL(OP_INFO) || NOT_EXCL(OP_SEARCH) || NOT_EXCL(OP_MSEARCH) ||
-			NOT_EXCL(OP_UPDATE|OP_DOWNLOAD)) {
-		fprintf(stderr, "error: invalid operation\n");
-		return 2;
+		if(due) {
+			long long until = (due - now_usec()) / 1000;
+			wait = until < wait ? (until > 0 ? (long)until : 0) : wait;
+		}
+		if(inflight) {
+			curl_multi_wait(multi, NULL, 0, wait, NULL);
+		} else {
+			sleep_usec(wait * 1000LL);
+		}
 	}
 
-	while(optind < argc) {
-		if(!alpm_list_find_str(cfg.targets, argv[optind])) {
-			cwr_printf(LOG_DEBUG, "adding target: %s\n", argv[optind]);
-			cfg.targets = alpm_list_add(cfg.targets, strdup(argv[optind]));
+finish:
+	for(n = 0; fetches && n < count; n++) {
+		response_put(fetches[n].response);
+		free(fetches[n].url);
+	}
+	for(n = 0; n < nidle; n++) {
+		if(idle[n] != curl) {
+			curl_handle_put(idle[n]);
 		}
-		optind++;
 	}
-
-	return 0;
+	free(fetches);
+	free(idle);
+	if(multi) {
+		curl_multi_cleanup(multi);
+	}
 } /* }}} */
 
-int pkg_is_binary(const char *pkg) /* {{{ */
+void pkgbuild_get_extinfo(const char *pkgbuild, size_t len, alpm_list_t **details[]) /* {{{ */
 {
-	const char *db = alpm_provides_pkg(pkg);
+	const char *ptr = pkgbuild, *end = pkgbuild + len;
+	struct strset_t seen = { NULL, 0, 0 };
+	int type;
 
-	if(db) {
-		cwr_fprintf(stderr, LOG_BRIEF, BRIEF_WARN "\t%s\t", pkg);
-		cwr_fprintf(stderr, LOG_WARN, "%s%s%s is available in %s%s%s\n",
-				colstr.pkg, pkg, colstr.nc,
-				colstr.repo, db, colstr.nc);
-		return 1;
+	if(!pkgbuild) {
+		return;
 	}
 
-	return 0;
-} /* }}} */
-
-void pkgbuild_get_extinfo(char *pkgbuild, alpm_list_t **details[]) /* {{{ */
-{
-	char *lineptr;
+	extinfo_seed(&seen, details);
 
-	for(lineptr = pkgbuild; lineptr; lineptr = strchr(lineptr, '\n')) {
-		char *arrayend;
-		int depth = 1, type = 0;
-		alpm_list_t **deplist;
-		size_t linelen;
+	/* one pass over the buffer. only a line which starts with one of the
+	 * array names followed by =( is looked at any further */
+	while(ptr < end) {
+		const char *key, *eol;
 
-		linelen = strtrim(++lineptr);
-		if(!linelen || *lineptr == '#') {
-			continue;
+		while(ptr < end && (*ptr == ' ' || *ptr == '\t')) {
+			ptr++;
 		}
 
-		if(startswith(lineptr, "depends=(")) {
-			deplist = details[PKGDETAIL_DEPENDS];
-		} else if(startswith(lineptr, "makedepends=(")) {
-			deplist = details[PKGDETAIL_MAKEDEPENDS];
-		} else if(startswith(lineptr, "optdepends=(")) {
-			deplist = details[PKGDETAIL_OPTDEPENDS];
-			type = PKGDETAIL_OPTDEPENDS;
-		} else if(startswith(lineptr, "provides=(")) {
-			deplist = details[PKGDETAIL_PROVIDES];
-		} else if(startswith(lineptr, "replaces=(")) {
-			deplist = details[PKGDETAIL_REPLACES];
-		} else if(startswith(lineptr, "conflicts=(")) {
-			deplist = details[PKGDETAIL_CONFLICTS];
-		} else {
-			continue;
+		key = ptr;
+		while(ptr < end && (islower((unsigned char)*ptr) || *ptr == '_')) {
+			ptr++;
 		}
 
-		if(deplist) {
-			char *arrayptr = (char*)memchr(lineptr, '(', linelen) + 1;
-			for(arrayend = arrayptr; depth; arrayend++) {
-				switch(*arrayend) {
-					case ')':
-						depth--;
-						break;
-					case '(':
-						depth++;
-						break;
-				}
+		if(end - ptr >= 2 && ptr[0] == '=' && ptr[1] == '(') {
+			type = pkgbuild_keyword(key, ptr - key);
+			if(type >= 0 && details[type]) {
+				ptr = parse_bash_array(ptr + 2, end, details[type], type, &seen);
 			}
-			*(arrayend - 1) = '\0';
-			*deplist = parse_bash_array(*deplist, arrayptr, type);
-			lineptr = arrayend;
+		}
+
+		eol = memchr(ptr, '\n', end - ptr);
+		ptr = eol ? eol + 1 : end;
+	}
+
+	strset_free(&seen);
+} /* }}} */
+
+int pkgbuild_keyword(const char *key, size_t len) /* {{{ */
+{
+	int i;
+
+	for(i = 0; i < PKGDETAIL_MAX; i++) {
+		if(strlen(pkgbuild_keys[i]) == len && memcmp(pkgbuild_keys[i], key, len) == 0) {
+			return i;
 		}
 	}
+
+	return -1;
 } /* }}} */
 
 int print_escaped(const char *delim) /* {{{ */
@@ -1689,10 +5979,11 @@ int print_escaped(const char *delim) /* {{{ */
 	return(out);
 } /* }}} */
 
-void print_extinfo_list(alpm_list_t *list, const char *fieldname, const char *delim, int wrap) /* {{{ */
+void print_extinfo_list(const struct aurpkg_t *pkg, pkgdetail_t type, /* {{{ */
+		const char *fieldname, const char *delim, int wrap)
 {
-	const alpm_list_t *next, *i;
-	size_t cols, count = 0;
+	size_t n, cols, count = 0, listlen;
+	const char **list = aurpkg_detail(pkg, type, &listlen);
 
 	if(!list) {
 		return;
@@ -1704,16 +5995,15 @@ void print_extinfo_list(alpm_list_t *list, const char *fieldname, const char *de
 		count += printf("%-*s: ", kInfoIndent - 2, fieldname);
 	}
 
-	for(i = list; i; i = next) {
-		size_t data_len = strlen(i->data);
-		next = alpm_list_next(i);
+	for(n = 0; n < listlen; n++) {
+		size_t data_len = strlen(list[n]);
 		if(wrap && cols > 0 && count + data_len >= cols) {
 			printf("%-*c", kInfoIndent + 1, '\n');
 			count = kInfoIndent;
 		}
 		count += data_len;
-		fputs(i->data, stdout);
-		if(next) {
+		fputs(list[n], stdout);
+		if(n + 1 < listlen) {
 			count += print_escaped(delim);
 		}
 	}
@@ -1782,22 +6072,22 @@ void print_pkg_formatted(struct aurpkg_t *pkg) /* {{{ */
 					break;
 				/* list based attributes */
 				case 'C':
-					print_extinfo_list(pkg->conflicts, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_CONFLICTS, NULL, cfg.delim, 0);
 					break;
 				case 'D':
-					print_extinfo_list(pkg->depends, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_DEPENDS, NULL, cfg.delim, 0);
 					break;
 				case 'M':
-					print_extinfo_list(pkg->makedepends, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_MAKEDEPENDS, NULL, cfg.delim, 0);
 					break;
 				case 'O':
-					print_extinfo_list(pkg->optdepends, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_OPTDEPENDS, NULL, cfg.delim, 0);
 					break;
 				case 'P':
-					print_extinfo_list(pkg->provides, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_PROVIDES, NULL, cfg.delim, 0);
 					break;
 				case 'R':
-					print_extinfo_list(pkg->replaces, NULL, cfg.delim, 0);
+					print_extinfo_list(pkg, PKGDETAIL_REPLACES, NULL, cfg.delim, 0);
 					break;
 				case '%':
 					fputc('%', stdout);
@@ -1827,10 +6117,12 @@ void print_pkg_info(struct aurpkg_t *pkg) /* {{{ */
 	char datestring[42];
 	struct tm *ts;
 	alpm_pkg_t *ipkg;
+	const char **optdepends;
+	size_t count;
 
 	printf("Repository     : %saur%s\n", colstr.repo, colstr.nc);
 	printf("Name           : %s%s%s", colstr.pkg, pkg->name, colstr.nc);
-	if((ipkg = alpm_db_get_pkg(db_local, pkg->name))) {
+	if((ipkg = alpm_db_get_pkg(alpm_localdb(), pkg->name))) {
 		const char *instcolor;
 		if(alpm_pkg_vercmp(pkg->ver, alpm_pkg_get_version(ipkg)) > 0) {
 			instcolor = colstr.ood;
@@ -1847,20 +6139,21 @@ void print_pkg_info(struct aurpkg_t *pkg) /* {{{ */
 	printf("AUR Page       : %s" AUR_PKG_URL_FORMAT "%s%s\n",
 			colstr.url, pkg->name, colstr.nc);
 
-	print_extinfo_list(pkg->depends, "Depends On", kListDelim, 1);
-	print_extinfo_list(pkg->makedepends, "Makdepends", kListDelim, 1);
-	print_extinfo_list(pkg->provides, "Provides", kListDelim, 1);
-	print_extinfo_list(pkg->conflicts, "Conflicts With", kListDelim, 1);
-
-	if(pkg->optdepends) {
-		const alpm_list_t *i;
-		printf("Optional Deps  : %s\n", (const char*)pkg->optdepends->data);
-		for(i = pkg->optdepends->next; i; i = alpm_list_next(i)) {
-			printf("%-*s%s\n", kInfoIndent, "", (const char*)i->data);
+	print_extinfo_list(pkg, PKGDETAIL_DEPENDS, "Depends On", kListDelim, 1);
+	print_extinfo_list(pkg, PKGDETAIL_MAKEDEPENDS, "Makdepends", kListDelim, 1);
+	print_extinfo_list(pkg, PKGDETAIL_PROVIDES, "Provides", kListDelim, 1);
+	print_extinfo_list(pkg, PKGDETAIL_CONFLICTS, "Conflicts With", kListDelim, 1);
+
+	optdepends = aurpkg_detail(pkg, PKGDETAIL_OPTDEPENDS, &count);
+	if(optdepends) {
+		size_t n;
+		printf("Optional Deps  : %s\n", optdepends[0]);
+		for(n = 1; n < count; n++) {
+			printf("%-*s%s\n", kInfoIndent, "", optdepends[n]);
 		}
 	}
 
-	print_extinfo_list(pkg->replaces, "Replaces", kListDelim, 1);
+	print_extinfo_list(pkg, PKGDETAIL_REPLACES, "Replaces", kListDelim, 1);
 
 	printf("Category       : %s\n"
 				 "License        : %s\n"
@@ -1894,7 +6187,7 @@ void print_pkg_search(struct aurpkg_t *pkg) /* {{{ */
 		printf("%saur/%s%s%s %s%s%s%s (%d)", colstr.repo, colstr.nc, colstr.pkg,
 				pkg->name, pkg->ood ? colstr.ood : colstr.utd, pkg->ver,
 				NCFLAG(pkg->ood, " <!>"), colstr.nc, pkg->votes);
-		if((ipkg = alpm_db_get_pkg(db_local, pkg->name))) {
+		if((ipkg = alpm_db_get_pkg(alpm_localdb(), pkg->name))) {
 			const char *instcolor;
 			if(alpm_pkg_vercmp(pkg->ver, alpm_pkg_get_version(ipkg)) > 0) {
 				instcolor = colstr.ood;
@@ -1903,98 +6196,599 @@ void print_pkg_search(struct aurpkg_t *pkg) /* {{{ */
 			}
 			printf(" %s[%sinstalled%s]%s", colstr.url, instcolor, colstr.url, colstr.nc);
 		}
-		printf("\n    ");
-		indentprint(pkg->desc, kSearchIndent);
-		fputc('\n', stdout);
+		printf("\n    ");
+		indentprint(pkg->desc, kSearchIndent);
+		fputc('\n', stdout);
+	}
+} /* }}} */
+
+void print_results(alpm_list_t *results, void (*printfn)(struct aurpkg_t*)) /* {{{ */
+{
+	const alpm_list_t *i;
+	struct aurpkg_t *prev = NULL;
+
+	if(!results && (cfg.opmask & OP_INFO)) {
+		cwr_fprintf(stderr, LOG_ERROR, "no results found\n");
+		return;
+	}
+
+	if(!printfn) {
+		return;
+	}
+
+	for(i = results; i; i = alpm_list_next(i)) {
+		struct aurpkg_t *pkg = i->data;
+
+		/* don't print duplicates */
+		if(!prev || aurpkg_cmp(pkg, prev) != 0) {
+			printfn(pkg);
+		}
+		prev = pkg;
+	}
+} /* }}} */
+
+int request_is_transient(CURLcode curlstat, long httpcode) /* {{{ */
+{
+	switch(curlstat) {
+		case CURLE_OK:
+			break;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SSL_CONNECT_ERROR:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			return 1;
+		default:
+			return 0;
+	}
+
+	switch(httpcode) {
+		case 408:
+		case 429:
+		case 500:
+		case 502:
+		case 503:
+		case 504:
+			return 1;
+		default:
+			return 0;
+	}
+} /* }}} */
+
+CURLcode request_status(struct request_t *req, CURLcode curlstat) /* {{{ */
+{
+	/* a sink that stopped reading because it already has everything it
+	 * needs is not a failed transfer */
+	if(curlstat == CURLE_WRITE_ERROR && req->complete && req->complete(req->writedata)) {
+		cwr_printf(LOG_DEBUG, "[%s]: response complete, closing transfer early\n",
+				req->target);
+		return CURLE_OK;
+	}
+
+	return curlstat;
+} /* }}} */
+
+int resolve_dependencies(const char *pkgname, const char *subdir) /* {{{ */
+{
+	const alpm_list_t *i;
+	alpm_list_t *deplist = NULL;
+	char *filename;
+	const char *pkgbuild;
+	size_t len;
+	int srcinfo, count = 0;
+	long long start = now_usec();
+
+	/* the .SRCINFO is exact where the PKGBUILD can only be guessed at */
+	cwr_asprintf(&filename, "%s/%s/.SRCINFO", cfg.dlpath, subdir ? subdir : pkgname);
+	srcinfo = access(filename, F_OK) == 0;
+	if(!srcinfo) {
+		free(filename);
+		cwr_asprintf(&filename, "%s/%s/PKGBUILD", cfg.dlpath, subdir ? subdir : pkgname);
+	}
+
+	pkgbuild = file_map(filename, &len);
+	if(!pkgbuild) {
+		free(filename);
+		return -1;
+	}
+
+	alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
+		&deplist, &deplist, NULL, NULL, NULL, NULL
+	};
+
+	cwr_printf(LOG_DEBUG, "Parsing %s for extended info\n", filename);
+	if(srcinfo) {
+		srcinfo_get_extinfo(pkgbuild, len, pkg_details);
+	} else {
+		pkgbuild_get_extinfo(pkgbuild, len, pkg_details);
+	}
+	file_unmap(pkgbuild, len);
+	free(filename);
+
+	for(i = deplist; i; i = alpm_list_next(i)) {
+		char *name = deps_want(i->data);
+
+		/* looked up and downloaded like any other target */
+		if(name) {
+			pipeline_enqueue(name);
+			count++;
+		}
+	}
+
+	FREELIST(deplist);
+	timeline_event("resolve deps", "deps", start, pkgname);
+
+	return count;
+} /* }}} */
+
+struct response_t *response_get(void) /* {{{ */
+{
+	struct response_t *response = NULL;
+
+	/* a few buffers are kept around, so that a run of downloads reuses one
+	 * allocation instead of growing a new one each time. They are shared,
+	 * because tarballs are fetched by one pool and let go of by another */
+	pthread_mutex_lock(&bufpool.lock);
+	if(bufpool.count > 0) {
+		response = bufpool.free[--bufpool.count];
+	}
+	pthread_mutex_unlock(&bufpool.lock);
+
+	return response ? response : calloc(1, sizeof(struct response_t));
+} /* }}} */
+
+void response_pool_drain(void) /* {{{ */
+{
+	pthread_mutex_lock(&bufpool.lock);
+	while(bufpool.count > 0) {
+		struct response_t *response = bufpool.free[--bufpool.count];
+		free(response->data);
+		free(response);
+	}
+	pthread_mutex_unlock(&bufpool.lock);
+} /* }}} */
+
+void response_put(struct response_t *response) /* {{{ */
+{
+	if(!response) {
+		return;
+	}
+
+	response_reset(response);
+	response->handle = NULL;
+
+	/* don't sit on the memory of an unusually large download */
+	if(response->capacity > kBufferRetainMax) {
+		free(response->data);
+		response->data = NULL;
+		response->capacity = 0;
+	}
+
+	pthread_mutex_lock(&bufpool.lock);
+	if(bufpool.count < (int)(sizeof(bufpool.free) / sizeof(bufpool.free[0]))) {
+		bufpool.free[bufpool.count++] = response;
+		response = NULL;
+	}
+	pthread_mutex_unlock(&bufpool.lock);
+
+	if(response) {
+		free(response->data);
+		free(response);
+	}
+} /* }}} */
+
+int response_reserve(struct response_t *response, size_t len) /* {{{ */
+{
+	char *newdata;
+	size_t capacity;
+
+	if(len <= response->capacity) {
+		return 0;
+	}
+
+	capacity = response->capacity ? response->capacity : kBufferMin;
+	while(capacity < len) {
+		capacity *= 2;
+	}
+
+	newdata = realloc(response->data, capacity);
+	if(!newdata) {
+		return 1;
+	}
+
+	response->data = newdata;
+	response->capacity = capacity;
+
+	return 0;
+} /* }}} */
+
+void response_reset(void *arg) /* {{{ */
+{
+	struct response_t *response = arg;
+
+	/* keep the allocation, only the contents go */
+	response->size = 0;
+	if(response->data) {
+		response->data[0] = '\0';
+	}
+} /* }}} */
+
+int run_operation(int argc, char *argv[]) /* {{{ */
+{
+	alpm_list_t *i, *results = NULL, *thread_return = NULL;
+	int ret, n, num_threads;
+	long long start, runstart = now_usec();
+	pthread_t *threads;
+	struct {
+		pthread_t thread;
+		int caches;
+	} preload = { .caches = 0 };
+	struct task_t task = {
+		.printfn = NULL,
+		.threadfn = task_query
+	};
+
+	/* initialize config. In daemon mode this runs once per request, so
+	 * nothing may be left over from the last one */
+	memset(&cfg, 0, sizeof(cfg));
+	optind = 0;
+	workq = NULL;
+	memset(&feed, 0, sizeof(feed));
+	worker_count = 0;
+	lockstat_reset();
+	run_deadline = 0;
+	timeline_events = 0;
+	cfg.color = cfg.maxthreads = cfg.timeout = kUnset;
+	cfg.reqtimeout = cfg.deadline = cfg.lowspeedlimit = cfg.lowspeedtime = kUnset;
+	cfg.retries = cfg.hedge = cfg.incremental = kUnset;
+	cfg.limit = cfg.sortkey = kUnset;
+	rpcbucket.rate = rpcbucket.burst = dlbucket.rate = dlbucket.burst = kUnset;
+	cfg.delim = kListDelim;
+	cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO;
+	cfg.ignoreood = kUnset;
+
+	ret = parse_options(argc, argv);
+	switch(ret) {
+		case 0: /* everything's cool */
+			break;
+		case 3:
+			fprintf(stderr, "error: no operation specified (use -h for help)\n");
+		case 1: /* these provide their own error mesg */
+		case 2:
+			return ret;
+	}
+
+	if(parse_configfile() != 0) {
+		return 1;
+	}
+
+	/* fallback from sentinel values. MaxThreads is only a ceiling, the number
+	 * of requests actually in flight is adjusted as the run progresses */
+	cfg.maxthreads = cfg.maxthreads == kUnset ? kThreadCeiling : cfg.maxthreads;
+	limiter.ceiling = cfg.maxthreads;
+	limiter.limit = limiter.limit > 0 ? limiter.limit : kThreadDefault;
+	limiter.limit = limiter.limit < limiter.ceiling ? limiter.limit : limiter.ceiling;
+	cfg.timeout = cfg.timeout == kUnset ? kTimeoutDefault : cfg.timeout;
+	cfg.reqtimeout = cfg.reqtimeout == kUnset ? 0 : cfg.reqtimeout;
+	cfg.deadline = cfg.deadline == kUnset ? 0 : cfg.deadline;
+	cfg.lowspeedlimit = cfg.lowspeedlimit == kUnset ? kLowSpeedLimitDefault : cfg.lowspeedlimit;
+	cfg.lowspeedtime = cfg.lowspeedtime == kUnset ? kLowSpeedTimeDefault : cfg.lowspeedtime;
+	cfg.retries = cfg.retries == kUnset ? kRetriesDefault : cfg.retries;
+	cfg.hedge = cfg.hedge == kUnset ? 0 : cfg.hedge;
+	/* sorting without a limit is a limit nothing reaches */
+	cfg.limit = cfg.limit == kUnset ? (cfg.sortkey == kUnset ? 0 : INT_MAX) : cfg.limit;
+	cfg.sortkey = cfg.sortkey == kUnset ? SORT_NAME : cfg.sortkey;
+	cfg.incremental = cfg.incremental == kUnset ? 0 : cfg.incremental;
+	rpcbucket.rate = rpcbucket.rate == kUnset ? 0 : rpcbucket.rate;
+	dlbucket.rate = dlbucket.rate == kUnset ? 0 : dlbucket.rate;
+	/* by default, allow a second's worth of requests in a burst */
+	rpcbucket.burst = rpcbucket.burst == kUnset ? rpcbucket.rate : rpcbucket.burst;
+	dlbucket.burst = dlbucket.burst == kUnset ? dlbucket.rate : dlbucket.burst;
+	rpcbucket.burst = rpcbucket.burst < 1 ? 1 : rpcbucket.burst;
+	dlbucket.burst = dlbucket.burst < 1 ? 1 : dlbucket.burst;
+	if(cfg.deadline > 0) {
+		run_deadline = now_usec() + cfg.deadline * 1000000LL;
+	}
+	cfg.color = cfg.color == kUnset ? 0 : cfg.color;
+	cfg.ignoreood = cfg.ignoreood == kUnset ? 0 : cfg.ignoreood;
+
+	if(strings_init() != 0) {
+		return 1;
+	}
+
+	if(cfg.frompkgbuild) {
+		/* treat arguments as filenames to load/extract */
+		alpm_list_t *files = cfg.targets;
+
+		cfg.targets = workq = NULL;
+		strset_free(&targetset);
+		load_targets_from_files(files);
+	}
+
+	if(cfg.tracefile) {
+		tracefp = fopen(cfg.tracefile, "a");
+		if(!tracefp) {
+			cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n",
+					cfg.tracefile, strerror(errno));
+			ret = 1;
+			goto finish;
+		}
+	}
+
+	if(cfg.timeline) {
+		timelinefp = fopen(cfg.timeline, "w");
+		if(!timelinefp) {
+			cwr_fprintf(stderr, LOG_ERROR, "failed to open %s: %s\n",
+					cfg.timeline, strerror(errno));
+			ret = 1;
+			goto finish;
+		}
+		timeline_epoch = now_usec();
+		fputc('[', timelinefp);
+		timeline_event("main", NULL, 0, NULL);
+	}
+
+	if(cfg.cachedir && (cfg.opmask & OP_DOWNLOAD)) {
+		ret = cache_init();
+		if(ret != 0) {
+			goto finish;
+		}
+		history_load();
+	}
+
+	ret = set_working_dir();
+	if(ret != 0) {
+		goto finish;
+	}
+
+	/* alpm is only brought up once something asks for it */
+	alpm_refresh();
+
+	/* targets on stdin are worked on as they come in. Resolving dependencies
+	 * up front needs all of them first, though, and so does filtering search
+	 * results by every term */
+	if(cfg.fromstdin) {
+		cwr_printf(LOG_DEBUG, "reading targets from stdin\n");
+		feed.in = client_stdin ? client_stdin : stdin;
+		feed.reading = 1;
+		if((cfg.getdeps && !(cfg.opmask & OP_UPDATE)) || (cfg.opmask & OP_SEARCH)) {
+			feed_read(NULL);
+		} else if(pthread_create(&feed.thread, NULL, feed_read, NULL) == 0) {
+			feed.started = 1;
+		} else {
+			feed_read(NULL);
+		}
+		if(feed.ret != 0) {
+			ret = 1;
+			goto finish;
+		}
+
+		/* wait for something to do, or for the input to turn out empty */
+		timeline_lock(&listlock, &liststat);
+		while(feed.reading && !cfg.targets) {
+			timeline_wait(&pipeline.idle, &listlock, &liststat);
+		}
+		timeline_unlock(&listlock, &liststat);
+	}
+
+	/* pacman's IgnorePkg only matters when checking for updates */
+	if(cfg.opmask & OP_UPDATE) {
+		if(!alpm_load(0)) {
+			ret = 1;
+			goto finish;
+		}
+		for(i = pacman_ignore; i; i = alpm_list_next(i)) {
+			cwr_printf(LOG_DEBUG, "ignoring package: %s\n", (const char*)i->data);
+			cfg.ignore.pkgs = alpm_list_add(cfg.ignore.pkgs, strdup(i->data));
+		}
+	}
+
+	/* allow specific updates to be provided instead of examining all foreign
+	 * pkgs. Finding those means loading every db before the first query can
+	 * go out, so get DNS, TCP and TLS out of the way in the meantime */
+	if((cfg.opmask & OP_UPDATE) && !cfg.targets) {
+		pthread_t warmup[kWarmupConnections];
+		int warm = 0;
+
+		/* a daemon worker's pooled handles are already warm */
+		if(!curlpool) {
+			for(warm = 0; warm < kWarmupConnections && warm < limiter.limit; warm++) {
+				if(pthread_create(&warmup[warm], NULL, curl_warmup, NULL) != 0) {
+					break;
+				}
+			}
+		}
+
+		cfg.targets = alpm_find_foreign_pkgs();
+		for(i = cfg.targets; i; i = alpm_list_next(i)) {
+			strset_add(&targetset, NULL, i->data, strlen(i->data));
+		}
+
+		for(n = 0; n < warm; n++) {
+			pthread_join(warmup[n], NULL);
+		}
 	}
-} /* }}} */
 
-void print_results(alpm_list_t *results, void (*printfn)(struct aurpkg_t*)) /* {{{ */
-{
-	const alpm_list_t *i;
-	struct aurpkg_t *prev = NULL;
+	/* everything else can start querying straight away, with whatever alpm
+	 * state the operation is going to read loading alongside */
+	if(cfg.opmask & OP_UPDATE) {
+		preload.caches |= CACHE_LOCALDB;
+	}
+	if(cfg.opmask & OP_DOWNLOAD) {
+		preload.caches |= CACHE_SYNCDBS | (cfg.getdeps ? CACHE_LOCALDB : 0);
+	} else if(!cfg.format && ((cfg.opmask & OP_INFO) ||
+				((cfg.opmask & (OP_SEARCH|OP_MSEARCH)) && !cfg.quiet))) {
+		preload.caches |= CACHE_LOCALDB;
+	}
+	preload.caches &= ~alpmstate.loaded;
+	if(preload.caches && pthread_create(&preload.thread, NULL, alpm_preload,
+				&preload.caches) != 0) {
+		preload.caches = 0;
+	}
 
-	if(!printfn) {
-		return;
+	/* more targets may still be on their way. Once they're all known, what
+	 * took longest last time goes first */
+	timeline_lock(&listlock, &liststat);
+	if(history.entries && !feed.reading) {
+		cfg.targets = history_order(cfg.targets);
+	}
+	workq = cfg.targets;
+	num_threads = feed.reading ? cfg.maxthreads : (int)alpm_list_count(cfg.targets);
+	timeline_unlock(&listlock, &liststat);
+	if(num_threads == 0) {
+		fprintf(stderr, "error: no targets specified (use -h for help)\n");
+		goto finish;
+	} else if(num_threads > cfg.maxthreads) {
+		num_threads = cfg.maxthreads;
 	}
 
-	if(!results && (cfg.opmask & OP_INFO)) {
-		cwr_fprintf(stderr, LOG_ERROR, "no results found\n");
-		return;
+	if(filter_init() != 0) {
+		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for search filters\n");
+		goto finish;
 	}
 
-	for(i = results; i; i = alpm_list_next(i)) {
-		struct aurpkg_t *pkg = i->data;
+	threads = malloc(num_threads * sizeof(pthread_t));
+	if(threads == NULL) {
+		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for threads\n");
+		goto finish;
+	}
 
-		/* don't print duplicates */
-		if(!prev || aurpkg_cmp(pkg, prev) != 0) {
-			printfn(pkg);
-		}
-		prev = pkg;
+	/* override task behavior */
+	if(cfg.opmask & OP_UPDATE) {
+		task.threadfn = task_update;
+	} else if(cfg.opmask & OP_INFO) {
+		task.printfn = cfg.format ? print_pkg_formatted : print_pkg_info;
+	} else if(cfg.opmask & (OP_SEARCH|OP_MSEARCH)) {
+		task.printfn = cfg.format ? print_pkg_formatted : print_pkg_search;
+	} else if(cfg.opmask & OP_DOWNLOAD) {
+		task.threadfn = task_download;
+	}
+	if(cfg.output) {
+		/* everything has been written out by the workers already */
+		task.printfn = NULL;
 	}
-} /* }}} */
 
-int resolve_dependencies(CURL *curl, const char *pkgname, const char *subdir) /* {{{ */
-{
-	const alpm_list_t *i;
-	alpm_list_t *deplist = NULL;
-	char *filename, *pkgbuild;
-	void *retval;
+	/* downloads are handed from these workers, which only do the lookups, to
+	 * separate pools for fetching, extracting and scanning for dependencies */
+	if((cfg.opmask & OP_DOWNLOAD) && pipeline_start(num_threads) != 0) {
+		free(threads);
+		ret = 1;
+		goto finish;
+	}
 
-	curl = curl_init_easy_handle(curl);
+	/* the dependencies of explicit targets can be worked out from the RPC
+	 * alone. Updates only pull in dependencies of what turns out outdated */
+	if(pipeline.active && cfg.getdeps && !(cfg.opmask & OP_UPDATE)) {
+		CURL *curl = curl_handle_get();
+		if(curl) {
+			deps_closure(curl);
+			curl_handle_put(curl);
+		}
+	}
 
-	cwr_asprintf(&filename, "%s/%s/PKGBUILD", cfg.dlpath, subdir ? subdir : pkgname);
+	metrics_phase(PHASE_SETUP, now_usec() - runstart);
+	for(n = 0; n < num_threads; n++) {
+		ret = pthread_create(&threads[n], NULL, thread_pool, &task);
+		if(ret != 0) {
+			cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
+					strerror(ret));
+			return(ret); /* we don't want to recover from this */
+		}
+	}
 
-	pkgbuild = get_file_as_buffer(filename);
-	if(!pkgbuild) {
-		return 1;
+	start = now_usec();
+	for(n = 0; n < num_threads; n++) {
+		pthread_join(threads[n], (void**)&thread_return);
+		results = alpm_list_join(results, thread_return);
 	}
+	free(threads);
+	if(feed.started) {
+		pthread_join(feed.thread, NULL);
+		feed.started = 0;
+	}
+	if(pipeline.active) {
+		pipeline_stop();
+		history_save();
+	}
+	if(preload.caches) {
+		pthread_join(preload.thread, NULL);
+		preload.caches = 0;
+	}
+	timeline_event("join", "main", start, NULL);
+	metrics_phase(PHASE_JOIN, now_usec() - start);
 
-	alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
-		&deplist, &deplist, NULL, NULL, NULL, NULL
-	};
+	/* we need to exit with a non-zero value when:
+	 * a) search/info/download returns nothing
+	 * b) update (without download) returns something
+	 * this is opposing behavior, so just XOR the result on a pure update */
+	runstart = now_usec();
+	results = filter_results(results);
+	if(cfg.limit && (cfg.opmask & (OP_SEARCH|OP_MSEARCH|OP_INFO))) {
+		results = limit_results(results);
+	}
+	ret = ((results == NULL) ^ !(cfg.opmask & ~OP_UPDATE));
+	start = now_usec();
+	print_results(results, task.printfn);
+	if(cfg.output && cfg.opmask != OP_DOWNLOAD && cfg.limit) {
+		/* the workers couldn't know what would make the cut */
+		output_results(results);
+	}
+	timeline_event("print", "main", start, NULL);
+	metrics_phase(PHASE_PRINT, now_usec() - runstart);
+	alpm_list_free_inner(results, aurpkg_free);
+	alpm_list_free(results);
 
-	cwr_printf(LOG_DEBUG, "Parsing %s for extended info\n", filename);
-	pkgbuild_get_extinfo(pkgbuild, pkg_details);
-	free(pkgbuild);
-	free(filename);
+finish:
+	if(preload.caches) {
+		pthread_join(preload.thread, NULL);
+	}
+	if(feed.started) {
+		pthread_join(feed.thread, NULL);
+	}
+	if(feed.ret != 0) {
+		ret = 1;
+	}
 
-	for(i = deplist; i; i = alpm_list_next(i)) {
-		const char *depend = i->data;
-		char *sanitized = strdup(depend);
+	if(cfg.logmask & LOG_DEBUG) {
+		lockstat_report();
+	}
 
-		sanitized[strcspn(sanitized, "<>=")] = '\0';
+	/* a run that failed is still worth knowing about */
+	if(cfg.metricsfile && metrics_write() != 0) {
+		ret = 1;
+	}
+	metrics_free();
 
-		if(!alpm_list_find_str(cfg.targets, sanitized)) {
-			pthread_mutex_lock(&listlock);
-			cfg.targets = alpm_list_add(cfg.targets, sanitized);
-			pthread_mutex_unlock(&listlock);
-		} else {
-			if(cfg.logmask & LOG_BRIEF &&
-							!alpm_find_satisfier(alpm_db_get_pkgcache(db_local), depend)) {
-					cwr_printf(LOG_BRIEF, "S\t%s\n", sanitized);
-			}
-			free(sanitized);
-		}
+	free(cfg.cachedir);
+	free(cfg.dlpath);
+	FREELIST(cfg.targets);
+	strset_free(&targetset);
+	strset_free(&emitted);
+	filter_free();
+	strpool_free();
+	history_free();
+	response_pool_drain();
+	FREELIST(cfg.ignore.pkgs);
+	FREELIST(cfg.ignore.repos);
 
-		if(sanitized) {
-			if(alpm_find_satisfier(alpm_db_get_pkgcache(db_local), depend)) {
-				cwr_printf(LOG_DEBUG, "%s is already satisified\n", depend);
-			} else {
-				if(!pkg_is_binary(depend)) {
-					retval = task_download(curl, sanitized);
-					alpm_list_free_inner(retval, aurpkg_free);
-					alpm_list_free(retval);
-				}
-			}
-		}
+	if(tracefp) {
+		fclose(tracefp);
+		tracefp = NULL;
 	}
 
-	FREELIST(deplist);
+	if(timelinefp) {
+		fputs("\n]\n", timelinefp);
+		fclose(timelinefp);
+		timelinefp = NULL;
+	}
 
-	return 0;
+	return ret;
 } /* }}} */
 
+
 int set_working_dir(void) /* {{{ */
 {
 	char *resolved;
@@ -2034,6 +6828,183 @@ int set_working_dir(void) /* {{{ */
 	return 0;
 } /* }}} */
 
+void sleep_usec(long long usec) /* {{{ */
+{
+	struct timespec ts;
+
+	if(usec <= 0) {
+		return;
+	}
+
+	/* usleep takes a 32 bit count, and needn't take a second or more at all */
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+} /* }}} */
+
+void *stage_worker(void *arg) /* {{{ */
+{
+	struct stage_t *stage = arg;
+	struct dljob_t *job;
+	CURL *curl = NULL;
+	const char *target;
+	long long start;
+
+	if(stage->network) {
+		/* a failed handle is reported per job, so the stage keeps draining */
+		curl = curl_handle_get();
+	}
+
+	timeline_lock(&listlock, &liststat);
+	worker_id = ++worker_count;
+	timeline_unlock(&listlock, &liststat);
+	jitter_seed = (unsigned int)now_usec() ^ worker_id;
+
+	if(timelinefp) {
+		char name[32];
+		snprintf(name, sizeof(name), "%s %d", stage->name, worker_id);
+		timeline_event(name, NULL, 0, NULL);
+	}
+
+	while(1) {
+		start = now_usec();
+		timeline_lock(&listlock, &liststat);
+		while(!stage->head && !pipeline.closing) {
+			timeline_wait(&stage->ready, &listlock, &liststat);
+		}
+		job = stage->head;
+		if(job) {
+			stage->head = job->next;
+			if(!stage->head) {
+				stage->tail = NULL;
+			}
+			stage->count--;
+			pthread_cond_signal(&stage->space);
+		}
+		timeline_unlock(&listlock, &liststat);
+		timeline_event("queue wait", "queue", start, NULL);
+
+		if(!job) {
+			break;
+		}
+
+		/* the job may be gone once the stage is done with it */
+		target = job->target;
+		start = now_usec();
+		stage->fn(curl, job);
+		timeline_event(stage->name, "job", start, target);
+	}
+
+	if(curl) {
+		curl_handle_put(curl);
+	}
+
+	return NULL;
+} /* }}} */
+
+void srcinfo_get_extinfo(const char *srcinfo, size_t len, alpm_list_t **details[]) /* {{{ */
+{
+	struct strset_t seen = { NULL, 0, 0 };
+	struct utsname host;
+	int pass, type, inpkg, overridden, inherit = 0;
+
+	if(!srcinfo) {
+		return;
+	}
+
+	/* arch specific arrays only count for the arch we're running on */
+	if(uname(&host) != 0) {
+		*host.machine = '\0';
+	}
+
+	extinfo_seed(&seen, details);
+
+	/* a split package which sets an array of its own replaces what it would
+	 * otherwise inherit from pkgbase. The first pass only works out whether
+	 * any package still inherits each of pkgbase's arrays, the second one
+	 * collects the entries */
+	for(pass = 0; pass < 2; pass++) {
+		const char *ptr = srcinfo, *end = srcinfo + len;
+
+		inpkg = overridden = 0;
+		while(ptr < end) {
+			const char *key, *keyend, *val, *valend, *eol;
+
+			eol = memchr(ptr, '\n', end - ptr);
+			eol = eol ? eol : end;
+
+			while(ptr < eol && isspace((unsigned char)*ptr)) {
+				ptr++;
+			}
+
+			key = ptr;
+			ptr = eol + 1;
+
+			/* a blank value may have lost the space after the = */
+			keyend = memmem(key, eol - key, " =", 2);
+			if(!keyend || *key == '#') {
+				continue;
+			}
+
+			val = keyend + 2;
+			val += val < eol && *val == ' ';
+			for(valend = eol; valend > val && isspace((unsigned char)*(valend - 1)); valend--);
+
+			if(keyend - key == 7 && memcmp(key, "pkgname", 7) == 0) {
+				if(inpkg) {
+					inherit |= ~overridden;
+				}
+				inpkg = 1;
+				overridden = 0;
+				continue;
+			}
+
+			type = srcinfo_keyword(key, keyend - key, host.machine);
+			if(type < 0) {
+				continue;
+			}
+
+			/* a blank value still overrides, it just doesn't add anything */
+			if(inpkg) {
+				overridden |= 1 << type;
+			}
+
+			if(pass == 1 && details[type] && valend > val &&
+					(inpkg || (inherit & (1 << type)))) {
+				extinfo_add(details[type], val, valend - val, &seen);
+			}
+		}
+
+		if(pass == 0) {
+			inherit = inpkg ? inherit | ~overridden : ~0;
+		}
+	}
+
+	strset_free(&seen);
+} /* }}} */
+
+int srcinfo_keyword(const char *key, size_t len, const char *arch) /* {{{ */
+{
+	size_t archlen = strlen(arch);
+	int i;
+
+	for(i = 0; i < PKGDETAIL_MAX; i++) {
+		size_t keylen = strlen(pkgbuild_keys[i]);
+
+		if(len < keylen || memcmp(pkgbuild_keys[i], key, keylen) != 0) {
+			continue;
+		}
+
+		/* either the plain array, or the one for this arch */
+		if(len == keylen || (archlen && len == keylen + 1 + archlen &&
+					key[keylen] == '_' && memcmp(key + keylen + 1, arch, archlen) == 0)) {
+			return i;
+		}
+	}
+
+	return -1;
+} /* }}} */
+
 int strings_init(void) /* {{{ */
 {
 	if(cfg.color > 0) {
@@ -2046,6 +7017,12 @@ int strings_init(void) /* {{{ */
 		colstr.ood = BOLDRED;
 		colstr.utd = BOLDGREEN;
 		colstr.nc = NC;
+	} else {
+		colstr.error = "error:";
+		colstr.warn = "warning:";
+		colstr.info = "::";
+		colstr.pkg = colstr.repo = colstr.url = "";
+		colstr.ood = colstr.utd = colstr.nc = "";
 	}
 
 	/* guard against delim being something other than kListDelim if extinfo
@@ -2071,6 +7048,139 @@ int string_to_key(const unsigned char *key, size_t len) /* {{{ */
 
 } /* }}} */
 
+void strpool_free(void) /* {{{ */
+{
+	pthread_mutex_lock(&strpool.lock);
+	FREELIST(strpool.blocks);
+	strset_free(&strpool.set);
+	strpool.next = NULL;
+	strpool.avail = 0;
+	pthread_mutex_unlock(&strpool.lock);
+} /* }}} */
+
+const char *strpool_intern(const char *str, size_t len) /* {{{ */
+{
+	const char *interned;
+
+	pthread_mutex_lock(&strpool.lock);
+	interned = strset_lookup(&strpool.set, NULL, str, len);
+	if(!interned) {
+		char *copy;
+
+		/* carved out of large blocks, which all go at once when the run is over */
+		if(len + 1 > strpool.avail) {
+			size_t size = len + 1 > kStrPoolBlock ? len + 1 : kStrPoolBlock;
+			char *block = malloc(size);
+			if(!block) {
+				pthread_mutex_unlock(&strpool.lock);
+				return NULL;
+			}
+			strpool.blocks = alpm_list_add(strpool.blocks, block);
+			strpool.next = block;
+			strpool.avail = size;
+		}
+
+		copy = strpool.next;
+		memcpy(copy, str, len);
+		copy[len] = '\0';
+		strpool.next += len + 1;
+		strpool.avail -= len + 1;
+
+		strset_add(&strpool.set, NULL, copy, len);
+		interned = copy;
+	}
+	pthread_mutex_unlock(&strpool.lock);
+
+	return interned;
+} /* }}} */
+
+int strptrcmp(const void *v1, const void *v2) /* {{{ */
+{
+	return strcmp(*(const char* const*)v1, *(const char* const*)v2);
+} /* }}} */
+
+int strset_add(struct strset_t *set, const void *owner, const char *str, size_t len) /* {{{ */
+{
+	size_t n, mask;
+	struct strentry_t *entry;
+
+	/* keep the table at most half full */
+	if((set->count + 1) * 2 > set->size) {
+		struct strentry_t *old = set->entries;
+		size_t oldsize = set->size;
+
+		set->size = set->size ? set->size * 2 : 16;
+		set->entries = calloc(set->size, sizeof(struct strentry_t));
+		if(!set->entries) {
+			set->entries = old;
+			set->size = oldsize;
+			return 1;
+		}
+		set->count = 0;
+		for(n = 0; n < oldsize; n++) {
+			if(old[n].str) {
+				strset_add(set, old[n].owner, old[n].str, old[n].len);
+			}
+		}
+		free(old);
+	}
+
+	mask = set->size - 1;
+	for(n = strset_hash(owner, str, len) & mask; set->entries[n].str; n = (n + 1) & mask) {
+		entry = &set->entries[n];
+		if(entry->owner == owner && entry->len == len && memcmp(entry->str, str, len) == 0) {
+			return 0;
+		}
+	}
+
+	set->entries[n].owner = owner;
+	set->entries[n].str = str;
+	set->entries[n].len = len;
+	set->count++;
+
+	return 1;
+} /* }}} */
+
+void strset_free(struct strset_t *set) /* {{{ */
+{
+	free(set->entries);
+	set->entries = NULL;
+	set->size = set->count = 0;
+} /* }}} */
+
+uint32_t strset_hash(const void *owner, const char *str, size_t len) /* {{{ */
+{
+	uint32_t hash = 2166136261u;
+	size_t n;
+
+	/* FNV-1a, with the owning list mixed in so that one set serves them all */
+	for(n = 0; n < len; n++) {
+		hash = (hash ^ (unsigned char)str[n]) * 16777619u;
+	}
+
+	return hash ^ (uint32_t)(uintptr_t)owner;
+} /* }}} */
+
+const char *strset_lookup(const struct strset_t *set, const void *owner, /* {{{ */
+		const char *str, size_t len)
+{
+	size_t n, mask;
+
+	if(!set->size) {
+		return NULL;
+	}
+
+	mask = set->size - 1;
+	for(n = strset_hash(owner, str, len) & mask; set->entries[n].str; n = (n + 1) & mask) {
+		const struct strentry_t *entry = &set->entries[n];
+		if(entry->owner == owner && entry->len == len && memcmp(entry->str, str, len) == 0) {
+			return entry->str;
+		}
+	}
+
+	return NULL;
+} /* }}} */
+
 size_t strtrim(char *str) /* {{{ */
 {
 	char *left = str, *right;
@@ -2090,13 +7200,33 @@ size_t strtrim(char *str) /* {{{ */
 		return 0;
 	}
 
-	right = (char*)rawmemchr(str, '\0') - 1;
-	while(isspace((unsigned char)*right)) {
-		right--;
+	right = (char*)rawmemchr(str, '\0') - 1;
+	while(isspace((unsigned char)*right)) {
+		right--;
+	}
+	*++right = '\0';
+
+	return right - left;
+} /* }}} */
+
+int target_add(const char *name, size_t len) /* {{{ */
+{
+	char *target = strndup(name, len);
+
+	/* listlock must be held once any workers are running. Dependencies are
+	 * tracked in the same set, so nothing is ever queued twice */
+	if(!target || !strset_add(&targetset, NULL, target, len)) {
+		free(target);
+		return 0;
+	}
+
+	cwr_printf(LOG_DEBUG, "adding target: %s\n", target);
+	cfg.targets = alpm_list_add(cfg.targets, target);
+	if(!workq) {
+		workq = alpm_list_last(cfg.targets);
 	}
-	*++right = '\0';
 
-	return right - left;
+	return 1;
 } /* }}} */
 
 void *task_download(CURL *curl, void *arg) /* {{{ */
@@ -2112,12 +7242,18 @@ void *task_query(CURL *curl, void *arg) /* {{{ */
 {
 	alpm_list_t *pkglist = NULL;
 	CURLcode curlstat;
-	struct yajl_handle_t *yajl_hand = NULL;
 	const char *argstr;
 	char *escaped, *url;
 	long httpcode;
 	int span = 0;
 	struct yajl_parser_t *parse_struct;
+	struct request_t req = {
+		.type = REQUEST_RPC,
+		.target = arg,
+		.writefn = yajl_parse_stream,
+		.reset = yajl_parser_reset,
+		.complete = yajl_parser_done
+	};
 
 	/* find a valid chunk of search string */
 	if(cfg.opmask & OP_SEARCH) {
@@ -2154,11 +7290,17 @@ void *task_query(CURL *curl, void *arg) /* {{{ */
 
 	parse_struct = calloc(1, sizeof(struct yajl_parser_t));
 	parse_struct->aurpkg = calloc(1, sizeof(struct aurpkg_t));
-	yajl_hand = yajl_alloc(&callbacks, NULL, (void*)parse_struct);
+	parse_struct->handle = yajl_alloc(&callbacks, NULL, (void*)parse_struct);
+	if(cfg.opmask & (OP_SEARCH|OP_MSEARCH|OP_INFO)) {
+		parse_struct->topk.limit = (size_t)cfg.limit;
+	}
+	if(!(cfg.opmask & (OP_SEARCH|OP_MSEARCH))) {
+		/* an info query for one name has at most one record */
+		parse_struct->expect = 1;
+	}
+	req.writedata = parse_struct;
 
 	curl = curl_init_easy_handle(curl);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, yajl_parse_stream);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, yajl_hand);
 
 	escaped = url_escape((char*)argstr, span, NULL);
 	if(cfg.opmask & OP_SEARCH) {
@@ -2171,7 +7313,7 @@ void *task_query(CURL *curl, void *arg) /* {{{ */
 	curl_easy_setopt(curl, CURLOPT_URL, url);
 
 	cwr_printf(LOG_DEBUG, "[%s]: curl_easy_perform %s\n", (const char *)arg, url);
-	curlstat = curl_easy_perform(curl);
+	curlstat = curl_perform(curl, &req);
 
 	if(curlstat != CURLE_OK) {
 		cwr_fprintf(stderr, LOG_ERROR, "[%s]: %s\n", (const char*)arg,
@@ -2179,7 +7321,7 @@ void *task_query(CURL *curl, void *arg) /* {{{ */
 		goto finish;
 	}
 
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
+	httpcode = req.httpcode;
 	cwr_printf(LOG_DEBUG, "[%s]: server responded with %ld\n", (const char *)arg, httpcode);
 	if(httpcode >= 400) {
 		cwr_fprintf(stderr, LOG_ERROR, "[%s]: server responded with HTTP %ld\n",
@@ -2187,39 +7329,24 @@ void *task_query(CURL *curl, void *arg) /* {{{ */
 		goto finish;
 	}
 
-	yajl_complete_parse(yajl_hand);
+	if(!parse_struct->done) {
+		yajl_complete_parse(parse_struct->handle);
+	}
 	if(parse_struct->error) {
 		cwr_fprintf(stderr, LOG_ERROR, "[%s]: query failed: %s\n",
 				(const char*)arg, parse_struct->error);
 		goto finish;
 	}
 
-	pkglist = parse_struct->pkglist;
+	pkglist = parse_struct->topk.limit ? topk_drain(&parse_struct->topk) : parse_struct->pkglist;
 
 	if(pkglist && cfg.extinfo) {
-		struct aurpkg_t *aurpkg;
-		char *pburl, *escaped, *pkgbuild;
-
-		aurpkg = pkglist->data;
-		escaped = url_escape(aurpkg->urlpath, 0, "/");
-		cwr_asprintf(&pburl, AUR_BASE_URL "%s", escaped);
-		memcpy(strrchr(pburl, '/') + 1, "PKGBUILD\0", 9);
-
-		pkgbuild = curl_get_url_as_buffer(curl, pburl);
-		free(escaped);
-		free(pburl);
-
-		alpm_list_t **pkg_details[PKGDETAIL_MAX] = {
-			&aurpkg->depends, &aurpkg->makedepends, &aurpkg->optdepends,
-			&aurpkg->provides, &aurpkg->conflicts, &aurpkg->replaces
-		};
-
-		pkgbuild_get_extinfo(pkgbuild, pkg_details);
-		free(pkgbuild);
+		pkgbuild_fetch_extinfo(curl, pkglist);
 	}
 
 finish:
-	yajl_free(yajl_hand);
+	topk_free(&parse_struct->topk);
+	yajl_free(parse_struct->handle);
 	curl_free(escaped);
 	free(parse_struct->aurpkg);
 	free(parse_struct->error);
@@ -2243,7 +7370,7 @@ void *task_update(CURL *curl, void *arg) /* {{{ */
 	aurpkg = qretval ? ((alpm_list_t*)qretval)->data : NULL;
 	if(aurpkg) {
 
-		pmpkg = alpm_db_get_pkg(db_local, arg);
+		pmpkg = alpm_db_get_pkg(alpm_localdb(), arg);
 
 		if(!pmpkg) {
 			cwr_fprintf(stderr, LOG_WARN, "skipping uninstalled package %s\n",
@@ -2267,7 +7394,7 @@ void *task_update(CURL *curl, void *arg) /* {{{ */
 				dlretval = task_download(curl, (void*)aurpkg->name);
 				alpm_list_free_inner(dlretval, aurpkg_free);
 				alpm_list_free(dlretval);
-			} else {
+			} else if(!cfg.output) {
 				if(cfg.quiet) {
 					printf("%s%s%s\n", colstr.pkg, candidate, colstr.nc);
 				} else {
@@ -2288,58 +7415,338 @@ finish:
 	return NULL;
 } /* }}} */
 
+int term_isatty(void) /* {{{ */
+{
+	/* when serving a client, stdout is only a stand-in for the client's own */
+	return client_tty != -1 ? client_tty : isatty(fileno(stdout));
+} /* }}} */
+
 void *thread_pool(void *arg) /* {{{ */
 {
 	alpm_list_t *ret = NULL;
 	CURL *curl;
 	void *job;
 	struct task_t *task = arg;
+	long long start;
+	int dep;
 
-	curl = curl_easy_init();
+	curl = curl_handle_get();
 	if(!curl) {
 		cwr_fprintf(stderr, LOG_ERROR, "curl: failed to initialize handle\n");
 		return NULL;
 	}
 
+	timeline_lock(&listlock, &liststat);
+	worker_id = ++worker_count;
+	timeline_unlock(&listlock, &liststat);
+	jitter_seed = (unsigned int)now_usec() ^ worker_id;
+
+	if(timelinefp) {
+		char name[32];
+		snprintf(name, sizeof(name), "worker %d", worker_id);
+		timeline_event(name, NULL, 0, NULL);
+	}
+
 	while(1) {
 		job = NULL;
-
-		/* try to pop off the work queue */
-		pthread_mutex_lock(&listlock);
-		if(workq) {
-			job = workq->data;
-			workq = alpm_list_next(workq);
+		dep = 0;
+
+		/* try to pop off the work queue. while downloading, dependencies turn
+		 * up behind us, so hang around until nothing is left in flight */
+		start = now_usec();
+		timeline_lock(&listlock, &liststat);
+		while(1) {
+			if(workq) {
+				job = workq->data;
+				workq = alpm_list_next(workq);
+				pipeline.busy += pipeline.active;
+			} else if(pipeline.depq) {
+				alpm_list_t *head = pipeline.depq;
+				job = head->data;
+				pipeline.depq = alpm_list_remove_item(pipeline.depq, head);
+				free(head);
+				dep = 1;
+			} else if(feed.reading || (pipeline.active && pipeline.busy > 0)) {
+				timeline_wait(&pipeline.idle, &listlock, &liststat);
+				continue;
+			}
+			break;
 		}
-		pthread_mutex_unlock(&listlock);
+		timeline_unlock(&listlock, &liststat);
+		timeline_event("queue wait", "queue", start, NULL);
 
 		/* make sure we hooked a new job */
 		if(!job) {
 			break;
 		}
 
-		ret = alpm_list_join(ret, task->threadfn(curl, job));
+		start = now_usec();
+		if(dep) {
+			/* dependencies aren't part of the results */
+			alpm_list_t *deps = task_download(curl, job);
+			alpm_list_free_inner(deps, aurpkg_free);
+			alpm_list_free(deps);
+		} else {
+			alpm_list_t *found = task->threadfn(curl, job);
+
+			/* machine readable output goes out as soon as it's in */
+			if(cfg.output && cfg.opmask != OP_DOWNLOAD && !cfg.limit) {
+				found = filter_results(found);
+				output_results(found);
+			}
+			ret = alpm_list_join(ret, found);
+		}
+		timeline_event("job", "job", start, job);
+
+		if(pipeline.active) {
+			pipeline_release();
+		}
 	}
 
-	curl_easy_cleanup(curl);
+	curl_handle_put(curl);
 
 	return ret;
 } /* }}} */
 
+void timeline_event(const char *name, const char *cat, long long start, /* {{{ */
+		const char *target)
+{
+	long long end;
+
+	if(!timelinefp) {
+		return;
+	}
+
+	end = now_usec();
+
+	flockfile(timelinefp);
+	fputs(timeline_events++ ? ",\n" : "\n", timelinefp);
+	if(!cat) {
+		/* metadata event naming the calling thread's track */
+		fprintf(timelinefp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+				"\"tid\":%d,\"args\":{\"name\":", worker_id);
+		json_fputs(name, timelinefp);
+		fputs("}}", timelinefp);
+	} else {
+		fputs("{\"name\":", timelinefp);
+		json_fputs(name, timelinefp);
+		fprintf(timelinefp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+				"\"pid\":1,\"tid\":%d", cat, start - timeline_epoch, end - start,
+				worker_id);
+		if(target) {
+			fputs(",\"args\":{\"target\":", timelinefp);
+			json_fputs(target, timelinefp);
+			fputc('}', timelinefp);
+		}
+		fputc('}', timelinefp);
+	}
+	funlockfile(timelinefp);
+} /* }}} */
+
+void timeline_lock(pthread_mutex_t *lock, struct lockstat_t *stat) /* {{{ */
+{
+	long long start, wait = 0;
+	int counted = (cfg.logmask & LOG_DEBUG) != 0;
+
+	if(!timelinefp && !counted) {
+		pthread_mutex_lock(lock);
+		return;
+	}
+
+	/* only contended acquisitions are interesting enough to time */
+	if(pthread_mutex_trylock(lock) != 0) {
+		start = now_usec();
+		pthread_mutex_lock(lock);
+		wait = now_usec() - start;
+		timeline_event(stat->name, "lock", start, NULL);
+		if(counted) {
+			stat->contended++;
+		}
+	}
+
+	/* the stats belong to whoever holds the lock, so they need none of their
+	 * own */
+	if(counted) {
+		stat->acquired++;
+		stat->waittotal += wait;
+		if(wait > stat->waitmax) {
+			stat->waitmax = wait;
+		}
+		stat->since = now_usec();
+	}
+} /* }}} */
+
+void timeline_unlock(pthread_mutex_t *lock, struct lockstat_t *stat) /* {{{ */
+{
+	if(stat->since) {
+		long long held = now_usec() - stat->since;
+
+		stat->holdtotal += held;
+		if(held > stat->holdmax) {
+			stat->holdmax = held;
+		}
+		stat->since = 0;
+	}
+
+	pthread_mutex_unlock(lock);
+} /* }}} */
+
+void timeline_wait(pthread_cond_t *cond, pthread_mutex_t *lock, /* {{{ */
+		struct lockstat_t *stat)
+{
+	/* sleeping on the condition doesn't count as holding the lock */
+	if(stat->since) {
+		long long held = now_usec() - stat->since;
+
+		stat->holdtotal += held;
+		if(held > stat->holdmax) {
+			stat->holdmax = held;
+		}
+		stat->since = 0;
+	}
+
+	pthread_cond_wait(cond, lock);
+
+	/* waking up takes the lock again, which counts as an acquisition of its
+	 * own. The time spent asleep isn't waiting for the lock, though */
+	if(cfg.logmask & LOG_DEBUG) {
+		stat->acquired++;
+		stat->since = now_usec();
+	}
+} /* }}} */
+
+alpm_list_t *topk_drain(struct topk_t *topk) /* {{{ */
+{
+	alpm_list_t *list = NULL;
+	size_t n;
+
+	for(n = 0; n < topk->count; n++) {
+		list = alpm_list_add(list, topk->pkgs[n]);
+	}
+	list = alpm_list_msort(list, topk->count, aurpkg_rankcmp);
+
+	free(topk->pkgs);
+	topk->pkgs = NULL;
+	topk->count = topk->capacity = 0;
+
+	return list;
+} /* }}} */
+
+void topk_free(struct topk_t *topk) /* {{{ */
+{
+	size_t n;
+
+	for(n = 0; n < topk->count; n++) {
+		aurpkg_free(topk->pkgs[n]);
+	}
+	free(topk->pkgs);
+	topk->pkgs = NULL;
+	topk->count = topk->capacity = 0;
+} /* }}} */
+
+void topk_offer(struct topk_t *topk, struct aurpkg_t *pkg) /* {{{ */
+{
+	struct aurpkg_t **pkgs = topk->pkgs;
+	size_t n, child;
+
+	/* a heap with the worst of the best on top, so whatever doesn't beat it
+	 * can be thrown away straight away */
+	if(topk->count < topk->limit) {
+		if(topk->count == topk->capacity) {
+			size_t capacity = topk->capacity ? topk->capacity * 2 : 16;
+			capacity = capacity < topk->limit ? capacity : topk->limit;
+			pkgs = realloc(topk->pkgs, capacity * sizeof(struct aurpkg_t*));
+			if(!pkgs) {
+				aurpkg_free(pkg);
+				return;
+			}
+			topk->pkgs = pkgs;
+			topk->capacity = capacity;
+		}
+
+		for(n = topk->count++; n > 0 && aurpkg_rankcmp(pkgs[(n - 1) / 2], pkg) < 0;
+				n = (n - 1) / 2) {
+			pkgs[n] = pkgs[(n - 1) / 2];
+		}
+		pkgs[n] = pkg;
+		return;
+	}
+
+	if(topk->count == 0 || aurpkg_rankcmp(pkg, pkgs[0]) >= 0) {
+		aurpkg_free(pkg);
+		return;
+	}
+
+	aurpkg_free(pkgs[0]);
+	for(n = 0; (child = 2 * n + 1) < topk->count; n = child) {
+		if(child + 1 < topk->count && aurpkg_rankcmp(pkgs[child + 1], pkgs[child]) > 0) {
+			child++;
+		}
+		if(aurpkg_rankcmp(pkgs[child], pkg) <= 0) {
+			break;
+		}
+		pkgs[n] = pkgs[child];
+	}
+	pkgs[n] = pkg;
+} /* }}} */
+
+void trace_request(CURL *curl, reqtype_t type, const char *target, /* {{{ */
+		CURLcode curlstat)
+{
+	struct timespec now;
+	double namelookup = 0, connect = 0, appconnect = 0, starttransfer = 0, total = 0;
+	curl_off_t bytes = 0;
+	long httpcode = 0, connects = 0;
+	char *url = NULL;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &namelookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &starttransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+	/* one record per line. hold the stream lock so that records written by
+	 * concurrent workers never interleave */
+	flockfile(tracefp);
+	fprintf(tracefp, "{\"time\":%ld.%06ld,\"thread\":%d,\"type\":\"%s\",\"target\":",
+			(long)now.tv_sec, now.tv_nsec / 1000, worker_id, kRequestTypes[type]);
+	json_fputs(target, tracefp);
+	fputs(",\"url\":", tracefp);
+	json_fputs(url, tracefp);
+	fprintf(tracefp, ",\"curlcode\":%d,\"error\":", curlstat);
+	json_fputs(curlstat == CURLE_OK ? NULL : curl_easy_strerror(curlstat), tracefp);
+	fprintf(tracefp, ",\"http_code\":%ld,\"namelookup\":%.6f,\"connect\":%.6f,"
+			"\"appconnect\":%.6f,\"starttransfer\":%.6f,\"total\":%.6f,"
+			"\"bytes\":%" CURL_FORMAT_CURL_OFF_T ",\"reused\":%s}\n",
+			httpcode, namelookup, connect, appconnect, starttransfer, total,
+			bytes, curlstat == CURLE_OK && connects == 0 ? "true" : "false");
+	funlockfile(tracefp);
+} /* }}} */
+
 static char *url_escape(char *in, int len, const char *delim) /* {{{ */
 {
-	char *tok, *escaped;
+	char *tok, *escaped, *copy, *ptr;
 	char buf[2048] = { 0 };
 
 	if(!delim) {
 		return curl_easy_escape(NULL, in, len);
 	}
 
-	while((tok = strsep(&in, delim))) {
+	/* strsep() carves up what it's given, and the caller may still need it */
+	copy = ptr = strdup(in);
+	while((tok = strsep(&ptr, delim))) {
 		escaped = curl_easy_escape(NULL, tok, 0);
 		strcat(buf, escaped);
 		curl_free(escaped);
 		strcat(buf, delim);
 	}
+	free(copy);
 
 	return strndup(buf, strlen(buf) - 1);
 } /* }}} */
@@ -2359,10 +7766,31 @@ void usage(void) /* {{{ */
 	    "  -u, --update            check for updates against AUR -- can be combined "
 	                                 "with the -d flag\n\n");
 	fprintf(stderr, " General options:\n"
+	    "      --daemon            serve requests from other cower processes\n"
+	    "      --cache-dir <dir>   cache downloaded tarballs in dir\n"
 	    "  -f, --force             overwrite existing files when downloading\n"
 	    "  -h, --help              display this help and exit\n"
 	    "      --ignore <pkg>      ignore a package upgrade (can be used more than once)\n"
 	    "      --ignorerepo <repo> ignore some or all binary repos\n"
+	    "      --incremental[=content]\n"
+	    "                          only write files which changed when overwriting\n"
+	    "      --deadline <num>    give up on requests after num seconds of runtime\n"
+	    "      --download-burst <num>\n"
+	    "                          allow bursts of up to num downloads\n"
+	    "      --download-rate <num>\n"
+	    "                          limit downloads to num per second\n"
+	    "      --hedge             send a second RPC query when the first is slow\n"
+	    "      --low-speed-limit <num>\n"
+	    "                          minimum transfer speed in bytes per second\n"
+	    "      --low-speed-time <num>\n"
+	    "                          abort transfers below the minimum speed for num seconds\n"
+	    "      --no-daemon         don't hand the request to a running daemon\n"
+	    "      --prune             remove files not in the tarball when overwriting\n"
+	    "      --request-timeout <num>\n"
+	    "                          specify timeout for a whole request in seconds\n"
+	    "      --retries <num>     retry failed requests up to num times\n"
+	    "      --rpc-burst <num>   allow bursts of up to num RPC queries\n"
+	    "      --rpc-rate <num>    limit RPC queries to num per second\n"
 	    "  -t, --target <dir>      specify an alternate download directory\n"
 	    "      --threads <num>     limit number of threads created\n"
 	    "      --timeout <num>     specify connection timeout in seconds\n"
@@ -2374,8 +7802,16 @@ void usage(void) /* {{{ */
 	    "      --format <string>   print package output according to format string\n"
 	    "  -o, --ignore-ood        skip displaying out of date packages\n"
 	    "      --no-ignore-ood     the opposite of --ignore-ood\n"
+	    "      --output <format>   write results as jsonl or binary records\n"
+	    "      --limit <num>       only show the best num results\n"
 	    "      --listdelim <delim> change list format delimeter\n"
+	    "      --metrics-file <file>\n"
+	    "                          write Prometheus metrics to file on exit\n"
 	    "  -q, --quiet             output less\n"
+	    "      --sort <key>        rank results by name, votes, lastmod or firstsub\n"
+	    "      --timeline <file>   write a trace-event timeline of thread activity\n"
+	    "      --trace-requests <file>\n"
+	    "                          append per-request network timings to file\n"
 	    "  -v, --verbose           output more\n\n");
 } /* }}} */
 
@@ -2395,197 +7831,154 @@ void version(void) /* {{{ */
 
 size_t yajl_parse_stream(void *ptr, size_t size, size_t nmemb, void *stream) /* {{{ */
 {
-	struct yajl_handle_t *hand = stream;
+	struct yajl_parser_t *p = stream;
 	size_t realsize = size * nmemb;
 
-	yajl_parse(hand, ptr, realsize);
-
-	return realsize;
-} /* }}} */
-
-int read_targets_from_file(FILE *in, alpm_list_t **targets) { /* {{{ */
-	char line[BUFSIZ];
-	int i = 0, end = 0;
-	while(!end) {
-		line[i] = fgetc(in);
-
-		if(line[i] == EOF) {
-			end = 1;
-		}
-
-		if(isspace(line[i]) || end) {
-			line[i] = '\0';
-			/* avoid adding zero length arg, if multiple spaces separate args */
-			if(i > 0) {
-				if(!alpm_list_find_str(*targets, line)) {
-					cwr_printf(LOG_DEBUG, "adding target: %s\n", line);
-					*targets = alpm_list_add(*targets, strdup(line));
-				}
-				i = 0;
-			}
-		} else {
-			++i;
-			if(i >= BUFSIZ) {
-				cwr_fprintf(stderr, LOG_ERROR, "buffer overflow detected in stdin\n");
-				return -1;
-			}
-		}
+	if(p->done) {
+		return 0;
 	}
 
-	return 0;
-} /* }}} */
-
-int main(int argc, char *argv[]) {
-	alpm_list_t *results = NULL, *thread_return = NULL;
-	int ret, n, num_threads;
-	pthread_t *threads;
-	struct task_t task = {
-		.printfn = NULL,
-		.threadfn = task_query
-	};
+	yajl_parse(p->handle, ptr, realsize);
 
-	setlocale(LC_ALL, "");
+	/* a short write makes curl abort the transfer */
+	return p->done ? 0 : realsize;
+} /* }}} */
 
-	/* initialize config */
-	cfg.color = cfg.maxthreads = cfg.timeout = kUnset;
-	cfg.delim = kListDelim;
-	cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO;
-	cfg.ignoreood = kUnset;
+int yajl_parser_done(void *arg) /* {{{ */
+{
+	struct yajl_parser_t *p = arg;
 
-	ret = parse_options(argc, argv);
-	switch(ret) {
-		case 0: /* everything's cool */
-			break;
-		case 3:
-			fprintf(stderr, "error: no operation specified (use -h for help)\n");
-		case 1: /* these provide their own error mesg */
-		case 2:
-			return ret;
-	}
+	return p->done;
+} /* }}} */
 
-	if(parse_configfile() != 0) {
-		return 1;
-	}
+void yajl_parser_reset(void *arg) /* {{{ */
+{
+	struct yajl_parser_t *p = arg;
+
+	/* throw away everything from the failed attempt */
+	yajl_free(p->handle);
+	alpm_list_free_inner(p->pkglist, aurpkg_free);
+	alpm_list_free(p->pkglist);
+	topk_free(&p->topk);
+	aurpkg_free_inner(p->aurpkg);
+	free(p->error);
+
+	p->pkglist = NULL;
+	p->resultcount = 0;
+	p->version = 0;
+	p->json_depth = 0;
+	p->seen = 0;
+	p->done = 0;
+	p->error = NULL;
+	p->handle = yajl_alloc(&callbacks, NULL, p);
+} /* }}} */
 
-	/* fallback from sentinel values */
-	cfg.maxthreads = cfg.maxthreads == kUnset ? kThreadDefault : cfg.maxthreads;
-	cfg.timeout = cfg.timeout == kUnset ? kTimeoutDefault : cfg.timeout;
-	cfg.color = cfg.color == kUnset ? 0 : cfg.color;
-	cfg.ignoreood = cfg.ignoreood == kUnset ? 0 : cfg.ignoreood;
+int read_targets_from_file(FILE *in) { /* {{{ */
+	char *buf, *ptr, *end, *token;
+	size_t have = 0;
+	int fd = fileno(in), ret = 0;
 
-	if(strings_init() != 0) {
-		return 1;
+	buf = malloc(kStdinChunk);
+	if(!buf) {
+		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for stdin\n");
+		return -1;
 	}
 
-	if(cfg.frompkgbuild) {
-		/* treat arguments as filenames to load/extract */
-		cfg.targets = load_targets_from_files(cfg.targets);
-	} else if(alpm_list_find_str(cfg.targets, "-")) {
-		char *vdata;
-		cfg.targets = alpm_list_remove_str(cfg.targets, "-", &vdata);
-		free(vdata);
-		cwr_printf(LOG_DEBUG, "reading targets from stdin\n");
-		ret = read_targets_from_file(stdin, &cfg.targets);
-		if(ret != 0) {
-			goto finish;
+	while(1) {
+		ssize_t n;
+		int added = 0;
+
+		/* read() hands back whatever has arrived so far, where fread() would
+		 * sit on a pipe until the whole chunk had filled up */
+		if(fd >= 0) {
+			n = read(fd, buf + have, kStdinChunk - have);
+			if(n < 0 && errno == EINTR) {
+				continue;
+			}
+		} else {
+			n = fread(buf + have, 1, kStdinChunk - have, in);
+			if(n == 0 && ferror(in)) {
+				n = -1;
+			}
 		}
-		if(!freopen(ctermid(NULL), "r", stdin)) {
-			cwr_printf(LOG_DEBUG, "failed to reopen stdin for reading\n");
+		if(n < 0) {
+			cwr_fprintf(stderr, LOG_ERROR, "failed to read stdin: %s\n", strerror(errno));
+			ret = -1;
+			break;
 		}
-	}
-
-	ret = set_working_dir();
-	if(ret != 0) {
-		goto finish;
-	}
 
-	cwr_printf(LOG_DEBUG, "initializing curl\n");
-	ret = curl_global_init(CURL_GLOBAL_ALL);
-	openssl_crypto_init();
+		end = buf + have + n;
+		token = buf;
 
-	if(ret != 0) {
-		cwr_fprintf(stderr, LOG_ERROR, "failed to initialize curl\n");
-		goto finish;
-	}
+		/* targets go out to the workers a chunk at a time */
+		timeline_lock(&listlock, &liststat);
+		for(ptr = buf + have; ptr < end; ptr++) {
+			if(isspace((unsigned char)*ptr)) {
+				if(ptr > token) {
+					added += target_add(token, ptr - token);
+				}
+				token = ptr + 1;
+			}
+		}
+		if(n == 0 && end > token) {
+			added += target_add(token, end - token);
+		}
+		if(added) {
+			pthread_cond_broadcast(&pipeline.idle);
+		}
+		timeline_unlock(&listlock, &liststat);
 
-	pmhandle = alpm_init();
-	if(!pmhandle) {
-		cwr_fprintf(stderr, LOG_ERROR, "failed to initialize alpm library\n");
-		goto finish;
-	}
+		if(n == 0) {
+			break;
+		}
 
-	/* allow specific updates to be provided instead of examining all foreign pkgs */
-	if((cfg.opmask & OP_UPDATE) && !cfg.targets) {
-		cfg.targets = alpm_find_foreign_pkgs();
+		/* carry a partial target over into the next read */
+		have = end - token;
+		if(have == kStdinChunk) {
+			cwr_fprintf(stderr, LOG_ERROR, "buffer overflow detected in stdin\n");
+			ret = -1;
+			break;
+		}
+		memmove(buf, token, have);
 	}
 
-	workq = cfg.targets;
-	num_threads = alpm_list_count(cfg.targets);
-	if(num_threads == 0) {
-		fprintf(stderr, "error: no targets specified (use -h for help)\n");
-		goto finish;
-	} else if(num_threads > cfg.maxthreads) {
-		num_threads = cfg.maxthreads;
-	}
+	free(buf);
 
-	threads = malloc(num_threads * sizeof(pthread_t));
-	if(threads == NULL) {
-		cwr_fprintf(stderr, LOG_ERROR, "could not allocate memory for threads\n");
-		goto finish;
-	}
+	return ret;
+} /* }}} */
 
-	/* override task behavior */
-	if(cfg.opmask & OP_UPDATE) {
-		task.threadfn = task_update;
-	} else if(cfg.opmask & OP_INFO) {
-		task.printfn = cfg.format ? print_pkg_formatted : print_pkg_info;
-	} else if(cfg.opmask & (OP_SEARCH|OP_MSEARCH)) {
-		task.printfn = cfg.format ? print_pkg_formatted : print_pkg_search;
-	} else if(cfg.opmask & OP_DOWNLOAD) {
-		task.threadfn = task_download;
-	}
+int main(int argc, char *argv[]) {
+	int i, ret, client = 1, serve = 0;
 
-	/* filthy, filthy hack: prepopulate the package cache */
-	alpm_db_get_pkgcache(db_local);
+	setlocale(LC_ALL, "");
 
-	for(n = 0; n < num_threads; n++) {
-		ret = pthread_create(&threads[n], NULL, thread_pool, &task);
-		if(ret != 0) {
-			cwr_fprintf(stderr, LOG_ERROR, "failed to spawn new thread: %s\n",
-					strerror(ret));
-			return(ret); /* we don't want to recover from this */
+	/* options aren't parsed until run_operation, but what comes before it
+	 * gets to log too */
+	cfg.logmask = LOG_ERROR|LOG_WARN|LOG_INFO;
+	for(i = 1; i < argc && !streq(argv[i], "--"); i++) {
+		if(streq(argv[i], "--daemon")) {
+			serve = 1;
+			client = 0;
+		} else if(streq(argv[i], "--no-daemon")) {
+			client = 0;
+		} else if(streq(argv[i], "--debug")) {
+			cfg.logmask |= LOG_DEBUG;
 		}
 	}
 
-	for(n = 0; n < num_threads; n++) {
-		pthread_join(threads[n], (void**)&thread_return);
-		results = alpm_list_join(results, thread_return);
+	/* hand the request off to a resident daemon if one is listening, and
+	 * fall back to doing the work ourselves otherwise */
+	if(client && (ret = daemon_client(argc, argv)) != -1) {
+		return ret;
 	}
-	free(threads);
-
-	/* we need to exit with a non-zero value when:
-	 * a) search/info/download returns nothing
-	 * b) update (without download) returns something
-	 * this is opposing behavior, so just XOR the result on a pure update */
-	results = filter_results(results);
-	ret = ((results == NULL) ^ !(cfg.opmask & ~OP_UPDATE));
-	print_results(results, task.printfn);
-	alpm_list_free_inner(results, aurpkg_free);
-	alpm_list_free(results);
 
-	openssl_crypto_cleanup();
-
-finish:
-	free(cfg.dlpath);
-	FREELIST(cfg.targets);
-	FREELIST(cfg.ignore.pkgs);
-	FREELIST(cfg.ignore.repos);
+	if(global_init() != 0) {
+		return 1;
+	}
 
-	cwr_printf(LOG_DEBUG, "releasing curl\n");
-	curl_global_cleanup();
+	ret = serve ? daemon_serve() : run_operation(argc, argv);
 
-	cwr_printf(LOG_DEBUG, "releasing alpm\n");
-	alpm_release(pmhandle);
+	global_cleanup();
 
 	return ret;
 }